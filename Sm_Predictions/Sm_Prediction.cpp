@@ -1,230 +1,7042 @@
 #include <iostream>
+#include <istream>
+#include <ostream>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <queue>
 #include <algorithm>
+#include <array>
 #include <limits>
+#include <map>
 #include <stdexcept>
+#include <fstream>
 #include <chrono>
 #include <cassert>
+#include <cctype>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <sstream>
+#include <cstring>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <cstdio>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Number of worker threads used by the parallel analytics passes
+inline size_t hardwareThreads() {
+    unsigned count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+// Split [begin, end) into contiguous chunks and run fn(chunkBegin, chunkEnd) on each
+template <typename Fn>
+void parallelFor(size_t begin, size_t end, Fn fn) {
+    if (begin >= end) {
+        return;
+    }
+    size_t total = end - begin;
+    size_t threads = std::min(hardwareThreads(), total);
+    if (threads <= 1) {
+        fn(begin, end);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    size_t chunk = (total + threads - 1) / threads;
+    for (size_t t = 0; t < threads; t++) {
+        size_t chunkBegin = begin + t * chunk;
+        size_t chunkEnd = std::min(end, chunkBegin + chunk);
+        if (chunkBegin >= chunkEnd) {
+            break;
+        }
+        workers.emplace_back([&fn, chunkBegin, chunkEnd]() { fn(chunkBegin, chunkEnd); });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Bytes glibc malloc reserves for a request: 8 bytes of header, 16-byte
+// granularity, 32 bytes minimum. Lets node-based layouts be sized honestly.
+inline size_t mallocChunkBytes(size_t request) {
+    return std::max<size_t>(32, (request + 8 + 15) & ~size_t(15));
+}
+
+// What a counted allocation holds, see CountingAllocator
+enum class MemoryCategory { VertexMap, Adjacency, Snapshots, Indexes, Caches, Workspaces, Count };
+
+inline const char* memoryCategoryName(MemoryCategory category) {
+    static const char* const names[] = {"vertexMap", "adjacency", "snapshots", "indexes", "caches", "workspaces"};
+    return names[static_cast<size_t>(category)];
+}
+
+// Process-wide live totals of one category. The counters are statistics
+// only, so relaxed atomics are enough.
+struct MemoryCounter {
+    std::atomic<int64_t> requestedBytes{0};
+    std::atomic<int64_t> heapBytes{0};      // requests rounded up to malloc chunks
+    std::atomic<int64_t> peakHeapBytes{0};
+    std::atomic<int64_t> allocations{0};
+
+    void allocated(size_t bytes) {
+        int64_t chunk = static_cast<int64_t>(mallocChunkBytes(bytes));
+        requestedBytes.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        int64_t now = heapBytes.fetch_add(chunk, std::memory_order_relaxed) + chunk;
+        int64_t peak = peakHeapBytes.load(std::memory_order_relaxed);
+        while (now > peak && !peakHeapBytes.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    void released(size_t bytes) {
+        requestedBytes.fetch_sub(static_cast<int64_t>(bytes), std::memory_order_relaxed);
+        allocations.fetch_sub(1, std::memory_order_relaxed);
+        heapBytes.fetch_sub(static_cast<int64_t>(mallocChunkBytes(bytes)), std::memory_order_relaxed);
+    }
+};
+
+inline MemoryCounter* memoryCounters() {
+    static MemoryCounter counters[static_cast<size_t>(MemoryCategory::Count)];
+    return counters;
+}
+
+// Stateless allocator charging every allocation to a category, so the
+// containers that hold the graph, its indexes and caches report their exact
+// footprint without per-container state
+template <typename T, MemoryCategory Category>
+struct CountingAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = CountingAllocator<U, Category>;
+    };
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U, Category>&) {}
+
+    T* allocate(size_t count) {
+        T* pointer = std::allocator<T>().allocate(count);
+        memoryCounters()[static_cast<size_t>(Category)].allocated(count * sizeof(T));
+        return pointer;
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        memoryCounters()[static_cast<size_t>(Category)].released(count * sizeof(T));
+        std::allocator<T>().deallocate(pointer, count);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U, Category>&) const { return true; }
+    template <typename U>
+    bool operator!=(const CountingAllocator<U, Category>&) const { return false; }
+};
+
+template <typename T, MemoryCategory Category>
+using CountedVector = std::vector<T, CountingAllocator<T, Category>>;
+
+template <typename T, MemoryCategory Category>
+using CountedSet = std::unordered_set<T, std::hash<T>, std::equal_to<T>, CountingAllocator<T, Category>>;
+
+template <typename K, typename V, MemoryCategory Category>
+using CountedMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, CountingAllocator<std::pair<const K, V>, Category>>;
+
+// Allocator returning storage aligned for wide vector loads, charged to a
+// category like CountingAllocator
+template <typename T, MemoryCategory Category, size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Category, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Category, Alignment>&) {}
+
+    T* allocate(size_t count) {
+        T* pointer = static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+        memoryCounters()[static_cast<size_t>(Category)].allocated(count * sizeof(T));
+        return pointer;
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        memoryCounters()[static_cast<size_t>(Category)].released(count * sizeof(T));
+        ::operator delete(pointer, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Category, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Category, Alignment>&) const { return false; }
+};
+
+// Float arrays kept as indexes (PageRank, embeddings) and per-pass scratch
+using FloatArray = std::vector<float, AlignedAllocator<float, MemoryCategory::Indexes>>;
+using ScratchFloatArray = std::vector<float, AlignedAllocator<float, MemoryCategory::Workspaces>>;
+
+// Friend set of one user in the hash adjacency, and the map holding them
+using FriendSet = CountedSet<int, MemoryCategory::Adjacency>;
+using AdjacencyMap = CountedMap<int, FriendSet, MemoryCategory::VertexMap>;
+
+// Snapshot of the memory counters of every category
+struct MemoryStats {
+    struct Category {
+        const char* name = "";
+        int64_t requestedBytes = 0;
+        int64_t heapBytes = 0;
+        int64_t peakHeapBytes = 0;
+        int64_t allocations = 0;
+    };
+    std::vector<Category> categories;
+    int64_t requestedBytes = 0;
+    int64_t heapBytes = 0;
+};
+
+// Live bytes of all counted containers in the process, by category. Heap
+// bytes model glibc's chunk rounding, which dominates for node-based sets.
+inline MemoryStats memoryStats() {
+    MemoryStats stats;
+    for (size_t c = 0; c < static_cast<size_t>(MemoryCategory::Count); c++) {
+        const MemoryCounter& counter = memoryCounters()[c];
+        MemoryStats::Category category;
+        category.name = memoryCategoryName(static_cast<MemoryCategory>(c));
+        category.requestedBytes = counter.requestedBytes.load(std::memory_order_relaxed);
+        category.heapBytes = counter.heapBytes.load(std::memory_order_relaxed);
+        category.peakHeapBytes = counter.peakHeapBytes.load(std::memory_order_relaxed);
+        category.allocations = counter.allocations.load(std::memory_order_relaxed);
+        stats.requestedBytes += category.requestedBytes;
+        stats.heapBytes += category.heapBytes;
+        stats.categories.push_back(category);
+    }
+    return stats;
+}
+
+#ifndef SM_DISABLE_METRICS
+// Log-linear latency histogram in the style of HdrHistogram: 16 sub-buckets
+// per power of two keep every recorded value within 6.25% of its bucket.
+// Each histogram has a single writer (its owning thread), so recording is a
+// relaxed load and store per counter; readers may aggregate at any time.
+class LatencyHistogram {
+public:
+    static constexpr int subBucketBits = 4;
+    static constexpr uint64_t subBuckets = uint64_t(1) << subBucketBits;
+    static constexpr int maxExponent = 44;  // about 4.9 hours in nanoseconds
+    static constexpr size_t bucketCount = (maxExponent - subBucketBits + 2) * subBuckets;
+
+    void record(uint64_t nanos) {
+        bump(buckets[indexOf(nanos)], 1);
+        bump(sum, nanos);
+    }
+
+    uint64_t bucket(size_t index) const { return buckets[index].load(std::memory_order_relaxed); }
+    uint64_t total() const { return sum.load(std::memory_order_relaxed); }
+
+    static size_t indexOf(uint64_t nanos) {
+        nanos = std::min(nanos, (uint64_t(1) << (maxExponent + 1)) - 1);
+        if (nanos < subBuckets) {
+            return static_cast<size_t>(nanos);
+        }
+        int exponent = 63 - __builtin_clzll(nanos);
+        uint64_t mantissa = (nanos >> (exponent - subBucketBits)) & (subBuckets - 1);
+        return static_cast<size_t>((exponent - subBucketBits + 1) * subBuckets + mantissa);
+    }
+
+    // Midpoint of the values that map to a bucket
+    static double valueAt(size_t index) {
+        if (index < subBuckets) {
+            return static_cast<double>(index);
+        }
+        int exponent = static_cast<int>(index / subBuckets) + subBucketBits - 1;
+        uint64_t width = uint64_t(1) << (exponent - subBucketBits);
+        uint64_t lower = (subBuckets + index % subBuckets) * width;
+        return static_cast<double>(lower) + static_cast<double>(width - 1) / 2.0;
+    }
 
-class SocialNetwork {
 private:
-    // Adjacency list representation of the social graph
-    std::unordered_map<int, std::unordered_set<int>> graph;
+    std::array<std::atomic<uint64_t>, bucketCount> buckets{};
+    std::atomic<uint64_t> sum{0};
+
+    static void bump(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
 
+// Counter split over cache-line sized shards, so threads bumping it
+// concurrently do not contend on one line; summed when read
+class ShardedCounter {
 public:
-    
-    void addUser(int userId) {
-        if (graph.find(userId) == graph.end()) {
-            graph[userId] = std::unordered_set<int>();
+    void add(uint64_t amount = 1) {
+        shards[shardOfThread()].value.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        uint64_t result = 0;
+        for (const auto& shard : shards) {
+            result += shard.value.load(std::memory_order_relaxed);
         }
+        return result;
     }
 
-    // Add a connection between two users
-    void addConnection(int userId1, int userId2) {
-        // Ensure both users exist
-        addUser(userId1);
-        addUser(userId2);
+private:
+    static constexpr size_t shardCount = 8;
 
-        // Add bidirectional connection
-        graph[userId1].insert(userId2);
-        graph[userId2].insert(userId1);
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value{0};
+    };
+    Shard shards[shardCount];
+
+    static size_t shardOfThread() {
+        static std::atomic<size_t> nextShard{0};
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % shardCount;
+        return shard;
     }
+};
 
-    // Remove connection
-    void removeConnection(int userId1, int userId2) {
-        if (graph.find(userId1) != graph.end() && 
-            graph.find(userId2) != graph.end()) {
-            graph[userId1].erase(userId2);
-            graph[userId2].erase(userId1);
+// Latency summary of one API method, aggregated over all threads
+struct MethodMetrics {
+    std::string method;
+    uint64_t calls = 0;
+    uint64_t errors = 0;                    // calls that left through an exception
+    double totalSeconds = 0.0;
+    double p50Seconds = 0.0;
+    double p99Seconds = 0.0;
+    double p999Seconds = 0.0;
+};
+
+// Registry of instrumented methods. Every thread records into its own
+// histograms; collect() merges the live threads with those that exited.
+class MetricsRegistry {
+public:
+    static constexpr size_t maxMethods = 128;
+
+    static MetricsRegistry& instance() {
+        // Never destroyed, so threads exiting during shutdown can still retire
+        static MetricsRegistry* registry = new MetricsRegistry();
+        return *registry;
+    }
+
+    size_t registerMethod(const char* name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t id = 0; id < names.size(); id++) {
+            if (names[id] == name) {
+                return id;
+            }
+        }
+        if (names.size() == maxMethods) {
+            throw std::runtime_error("Too many instrumented methods");
+        }
+        names.push_back(name);
+        return names.size() - 1;
+    }
+
+    void record(size_t method, uint64_t nanos, bool failed) {
+        ThreadHistograms& local = threadHistograms();
+        LatencyHistogram* histogram = local.slots[method].load(std::memory_order_relaxed);
+        if (!histogram) {
+            histogram = new LatencyHistogram();
+            local.slots[method].store(histogram, std::memory_order_release);
+        }
+        histogram->record(nanos);
+        if (failed) {
+            errors[method].add();
+        }
+    }
+
+    std::vector<MethodMetrics> collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<MethodMetrics> result;
+        std::vector<uint64_t> merged(LatencyHistogram::bucketCount);
+        for (size_t id = 0; id < names.size(); id++) {
+            std::copy(retired[id].buckets.begin(), retired[id].buckets.end(), merged.begin());
+            uint64_t nanos = retired[id].sum;
+            for (ThreadHistograms* thread : threads) {
+                const LatencyHistogram* histogram = thread->slots[id].load(std::memory_order_acquire);
+                if (histogram) {
+                    for (size_t b = 0; b < merged.size(); b++) {
+                        merged[b] += histogram->bucket(b);
+                    }
+                    nanos += histogram->total();
+                }
+            }
+
+            MethodMetrics metrics;
+            metrics.method = names[id];
+            metrics.calls = std::accumulate(merged.begin(), merged.end(), uint64_t(0));
+            metrics.errors = errors[id].total();
+            metrics.totalSeconds = static_cast<double>(nanos) * 1e-9;
+            metrics.p50Seconds = quantile(merged, metrics.calls, 0.5);
+            metrics.p99Seconds = quantile(merged, metrics.calls, 0.99);
+            metrics.p999Seconds = quantile(merged, metrics.calls, 0.999);
+            result.push_back(metrics);
+        }
+        return result;
+    }
+
+private:
+    struct ThreadHistograms {
+        std::array<std::atomic<LatencyHistogram*>, maxMethods> slots{};
+
+        ThreadHistograms() {
+            MetricsRegistry& registry = instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.push_back(this);
+        }
+
+        // Fold this thread's counts into the retired totals
+        ~ThreadHistograms() {
+            MetricsRegistry& registry = instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+            for (size_t id = 0; id < maxMethods; id++) {
+                LatencyHistogram* histogram = slots[id].load(std::memory_order_relaxed);
+                if (histogram) {
+                    for (size_t b = 0; b < LatencyHistogram::bucketCount; b++) {
+                        registry.retired[id].buckets[b] += histogram->bucket(b);
+                    }
+                    registry.retired[id].sum += histogram->total();
+                    delete histogram;
+                }
+            }
+        }
+    };
+
+    struct RetiredHistogram {
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(LatencyHistogram::bucketCount, 0);
+        uint64_t sum = 0;
+    };
+
+    std::mutex mutex;
+    std::vector<std::string> names;
+    std::vector<ThreadHistograms*> threads;
+    std::vector<RetiredHistogram> retired = std::vector<RetiredHistogram>(maxMethods);
+    ShardedCounter errors[maxMethods];
+
+    MetricsRegistry() = default;
+
+    static ThreadHistograms& threadHistograms() {
+        thread_local ThreadHistograms histograms;
+        return histograms;
+    }
+
+    static double quantile(const std::vector<uint64_t>& buckets, uint64_t count, double q) {
+        if (count == 0) {
+            return 0.0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count)));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < buckets.size(); b++) {
+            seen += buckets[b];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return LatencyHistogram::valueAt(b) * 1e-9;
+            }
         }
+        return 0.0;
+    }
+};
+
+// Times the enclosing scope into the registry; calls leaving through an
+// exception also count as errors
+class MethodTimer {
+public:
+    explicit MethodTimer(size_t methodId)
+        : method(methodId), exceptions(std::uncaught_exceptions()), start(std::chrono::steady_clock::now()) {}
+
+    MethodTimer(const MethodTimer&) = delete;
+    MethodTimer& operator=(const MethodTimer&) = delete;
+
+    ~MethodTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        MetricsRegistry::instance().record(
+            method, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+            std::uncaught_exceptions() > exceptions);
+    }
+
+private:
+    size_t method;
+    int exceptions;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define SM_METRIC_SCOPE(name)                                                              \
+    static const size_t smMetricId = MetricsRegistry::instance().registerMethod(name);    \
+    MethodTimer smMetricTimer(smMetricId)
+#else
+#define SM_METRIC_SCOPE(name) ((void)0)
+#endif
+
+// Prometheus text exposition of the API latencies (unless compiled with
+// SM_DISABLE_METRICS) and of the memory counters
+inline void writePrometheusMetrics(std::ostream& out) {
+#ifndef SM_DISABLE_METRICS
+    std::vector<MethodMetrics> methods = MetricsRegistry::instance().collect();
+    out << "# HELP sm_api_latency_seconds Latency of SocialNetwork API calls.\n"
+        << "# TYPE sm_api_latency_seconds summary\n";
+    for (const auto& metrics : methods) {
+        std::string label = "method=\"" + metrics.method + "\"";
+        out << "sm_api_latency_seconds{" << label << ",quantile=\"0.5\"} " << metrics.p50Seconds << "\n"
+            << "sm_api_latency_seconds{" << label << ",quantile=\"0.99\"} " << metrics.p99Seconds << "\n"
+            << "sm_api_latency_seconds{" << label << ",quantile=\"0.999\"} " << metrics.p999Seconds << "\n"
+            << "sm_api_latency_seconds_sum{" << label << "} " << metrics.totalSeconds << "\n"
+            << "sm_api_latency_seconds_count{" << label << "} " << metrics.calls << "\n";
+    }
+    out << "# HELP sm_api_errors_total SocialNetwork API calls that threw.\n"
+        << "# TYPE sm_api_errors_total counter\n";
+    for (const auto& metrics : methods) {
+        out << "sm_api_errors_total{method=\"" << metrics.method << "\"} " << metrics.errors << "\n";
+    }
+#endif
+    MemoryStats memory = memoryStats();
+    out << "# HELP sm_memory_heap_bytes Heap bytes held by counted containers.\n"
+        << "# TYPE sm_memory_heap_bytes gauge\n";
+    for (const auto& category : memory.categories) {
+        out << "sm_memory_heap_bytes{category=\"" << category.name << "\"} " << category.heapBytes << "\n";
+    }
+    out << "# HELP sm_memory_peak_heap_bytes Peak heap bytes held by counted containers.\n"
+        << "# TYPE sm_memory_peak_heap_bytes gauge\n";
+    for (const auto& category : memory.categories) {
+        out << "sm_memory_peak_heap_bytes{category=\"" << category.name << "\"} " << category.peakHeapBytes << "\n";
+    }
+}
+
+// Write the metrics to a file for a textfile collector. The file is
+// replaced atomically so the collector never reads a partial dump.
+inline void dumpPrometheusMetrics(const std::string& path) {
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot create " + temporary);
+        }
+        writePrometheusMetrics(out);
+        if (!out) {
+            throw std::runtime_error("Failed to write " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Cannot replace " + path + ": " + std::strerror(errno));
+    }
+}
+
+// Dot product over arrays whose length is a multiple of 8.
+// Eight independent accumulators let the compiler keep the loop in vector registers.
+inline float dotProduct(const float* a, const float* b, size_t length) {
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (size_t i = 0; i < length; i += 8) {
+        for (size_t lane = 0; lane < 8; lane++) {
+            acc[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+// Cheap deterministic 64-bit mixer, used to derive per-vertex random seeds
+inline uint64_t mixBits(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ULL;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// Immutable compressed-sparse-row copy of the graph.
+// Vertices are renumbered densely (in ascending user id order) and every
+// row of neighbors is sorted, which the analytics passes rely on.
+struct GraphSnapshot {
+    CountedVector<int, MemoryCategory::Snapshots> ids;         // vertex index -> user id
+    CountedMap<int, int, MemoryCategory::Snapshots> index;     // user id -> vertex index
+    CountedVector<size_t, MemoryCategory::Snapshots> offsets;  // row offsets, size vertexCount() + 1
+    CountedVector<int, MemoryCategory::Snapshots> neighbors;   // concatenated sorted rows of vertex indices
+
+    size_t vertexCount() const { return ids.size(); }
+    size_t edgeCount() const { return neighbors.size(); }
+
+    size_t degree(int vertex) const {
+        return offsets[vertex + 1] - offsets[vertex];
+    }
+
+    const int* begin(int vertex) const { return neighbors.data() + offsets[vertex]; }
+    const int* end(int vertex) const { return neighbors.data() + offsets[vertex + 1]; }
+
+    // Vertex index of a user, or -1 if the user is not part of the snapshot
+    int vertexOf(int userId) const {
+        auto it = index.find(userId);
+        return it == index.end() ? -1 : it->second;
+    }
+};
+
+// Exclusive prefix sum of counts[0, n) into offsets[0, n]; blocks are summed in parallel
+inline void parallelPrefixSum(const size_t* counts, size_t n, size_t* offsets) {
+    size_t blocks = std::max<size_t>(1, std::min(hardwareThreads(), n / 4096));
+    size_t blockSize = (n + blocks - 1) / std::max<size_t>(1, blocks);
+    std::vector<size_t> blockSums(blocks + 1, 0);
+    parallelFor(0, blocks, [&](size_t first, size_t last) {
+        for (size_t b = first; b < last; b++) {
+            size_t sum = 0;
+            for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); i++) {
+                sum += counts[i];
+            }
+            blockSums[b + 1] = sum;
+        }
+    });
+    for (size_t b = 0; b < blocks; b++) {
+        blockSums[b + 1] += blockSums[b];
+    }
+    parallelFor(0, blocks, [&](size_t first, size_t last) {
+        for (size_t b = first; b < last; b++) {
+            size_t sum = blockSums[b];
+            for (size_t i = b * blockSize; i < std::min(n, (b + 1) * blockSize); i++) {
+                offsets[i] = sum;
+                sum += counts[i];
+            }
+        }
+    });
+    offsets[n] = blockSums[blocks];
+}
+
+// Build a CSR snapshot straight from an undirected edge array, without going
+// through the hash adjacency: ids are compacted, degrees counted with atomics,
+// offsets prefix-summed, both directions scattered with atomic cursors, then
+// every row is sorted and deduplicated. Self-loops are dropped. Users listed
+// in extraUsers are included even when they have no edges.
+inline GraphSnapshot buildSnapshotFromEdges(const std::pair<int, int>* edges, size_t edgeCount,
+                                            const std::vector<int>& extraUsers = {}) {
+    GraphSnapshot result;
+
+    // Id compaction. When ids span a small range (the common case) a presence
+    // table gives them in order and doubles as the id -> index map; otherwise
+    // per-chunk sorted unique endpoints are merged with one global sort.
+    std::mutex idsMutex;
+    int low = std::numeric_limits<int>::max();
+    int high = std::numeric_limits<int>::min();
+    for (int userId : extraUsers) {
+        low = std::min(low, userId);
+        high = std::max(high, userId);
+    }
+    parallelFor(0, edgeCount, [&](size_t begin, size_t end) {
+        int localLow = std::numeric_limits<int>::max();
+        int localHigh = std::numeric_limits<int>::min();
+        for (size_t e = begin; e < end; e++) {
+            localLow = std::min({localLow, edges[e].first, edges[e].second});
+            localHigh = std::max({localHigh, edges[e].first, edges[e].second});
+        }
+        std::lock_guard<std::mutex> lock(idsMutex);
+        low = std::min(low, localLow);
+        high = std::max(high, localHigh);
+    });
+
+    CountedVector<int, MemoryCategory::Snapshots> ids;
+    std::vector<int> denseTable;            // user id - low -> vertex index, when the range is small
+    uint64_t range = low <= high ? static_cast<uint64_t>(static_cast<int64_t>(high) - low) + 1 : 0;
+    if (range > 0 && range <= 4 * (2 * edgeCount + extraUsers.size()) + 1024) {
+        std::unique_ptr<std::atomic<uint8_t>[]> present(new std::atomic<uint8_t>[range]);
+        parallelFor(0, range, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                present[i].store(0, std::memory_order_relaxed);
+            }
+        });
+        for (int userId : extraUsers) {
+            present[userId - low].store(1, std::memory_order_relaxed);
+        }
+        parallelFor(0, edgeCount, [&](size_t begin, size_t end) {
+            for (size_t e = begin; e < end; e++) {
+                present[edges[e].first - low].store(1, std::memory_order_relaxed);
+                present[edges[e].second - low].store(1, std::memory_order_relaxed);
+            }
+        });
+        denseTable.assign(range, -1);
+        for (size_t i = 0; i < range; i++) {
+            if (present[i].load(std::memory_order_relaxed)) {
+                denseTable[i] = static_cast<int>(ids.size());
+                ids.push_back(static_cast<int>(low + static_cast<int64_t>(i)));
+            }
+        }
+    } else {
+        ids.assign(extraUsers.begin(), extraUsers.end());
+        parallelFor(0, edgeCount, [&](size_t begin, size_t end) {
+            std::vector<int> local;
+            local.reserve(2 * (end - begin));
+            for (size_t e = begin; e < end; e++) {
+                local.push_back(edges[e].first);
+                local.push_back(edges[e].second);
+            }
+            std::sort(local.begin(), local.end());
+            local.erase(std::unique(local.begin(), local.end()), local.end());
+            std::lock_guard<std::mutex> lock(idsMutex);
+            ids.insert(ids.end(), local.begin(), local.end());
+        });
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    size_t n = ids.size();
+    result.index.reserve(n);
+    for (size_t v = 0; v < n; v++) {
+        result.index[ids[v]] = static_cast<int>(v);
+    }
+    auto denseOf = [&](int userId) {
+        return !denseTable.empty() ? denseTable[userId - low]
+                                   : static_cast<int>(std::lower_bound(ids.begin(), ids.end(), userId) - ids.begin());
+    };
+
+    std::unique_ptr<std::atomic<size_t>[]> cursor(new std::atomic<size_t>[n + 1]);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            cursor[v].store(0, std::memory_order_relaxed);
+        }
+    });
+    parallelFor(0, edgeCount, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            if (edges[e].first != edges[e].second) {
+                cursor[denseOf(edges[e].first)].fetch_add(1, std::memory_order_relaxed);
+                cursor[denseOf(edges[e].second)].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    std::vector<size_t> degrees(n);
+    CountedVector<size_t, MemoryCategory::Snapshots> offsets(n + 1);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            degrees[v] = cursor[v].load(std::memory_order_relaxed);
+        }
+    });
+    parallelPrefixSum(degrees.data(), n, offsets.data());
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            cursor[v].store(offsets[v], std::memory_order_relaxed);
+        }
+    });
+
+    CountedVector<int, MemoryCategory::Snapshots> scattered(offsets[n]);
+    parallelFor(0, edgeCount, [&](size_t begin, size_t end) {
+        for (size_t e = begin; e < end; e++) {
+            if (edges[e].first != edges[e].second) {
+                int u = denseOf(edges[e].first);
+                int v = denseOf(edges[e].second);
+                scattered[cursor[u].fetch_add(1, std::memory_order_relaxed)] = v;
+                scattered[cursor[v].fetch_add(1, std::memory_order_relaxed)] = u;
+            }
+        }
+    });
+    cursor.reset();
+
+    // Sort and deduplicate every row in place, recording the surviving degree
+    std::atomic<size_t> duplicates(0);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        size_t removed = 0;
+        for (size_t v = begin; v < end; v++) {
+            int* first = scattered.data() + offsets[v];
+            int* last = scattered.data() + offsets[v + 1];
+            std::sort(first, last);
+            degrees[v] = static_cast<size_t>(std::unique(first, last) - first);
+            removed += static_cast<size_t>(last - first) - degrees[v];
+        }
+        duplicates.fetch_add(removed, std::memory_order_relaxed);
+    });
+
+    if (duplicates.load() == 0) {
+        result.neighbors.swap(scattered);
+        result.offsets.swap(offsets);
+    } else {
+        result.offsets.resize(n + 1);
+        parallelPrefixSum(degrees.data(), n, result.offsets.data());
+        result.neighbors.resize(result.offsets[n]);
+        parallelFor(0, n, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                std::copy(scattered.data() + offsets[v], scattered.data() + offsets[v] + degrees[v],
+                          result.neighbors.data() + result.offsets[v]);
+            }
+        });
+    }
+    result.ids.swap(ids);
+    return result;
+}
+
+// Persistent worker pool for the vertex-centric framework. One job runs at
+// a time; its index range is handed out in chunks through an atomic cursor
+// and the submitting thread works on it too. A parallelFor issued from inside
+// a job runs inline on the calling thread instead of deadlocking. If fn
+// throws, the remaining chunks are abandoned and the first exception is
+// rethrown on the submitting thread once every helper has left the job.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threadCount = hardwareThreads()) {
+        for (size_t t = 1; t < threadCount; t++) {
+            workers.emplace_back([this]() { workerLoop(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Pool shared by the analytics passes
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    // Run fn(chunkBegin, chunkEnd) over [begin, end) in chunks of `grain`
+    // indices (0 picks about eight chunks per thread)
+    template <typename Fn>
+    void parallelFor(size_t begin, size_t end, Fn fn, size_t grain = 0) {
+        if (begin >= end) {
+            return;
+        }
+        size_t total = end - begin;
+        if (grain == 0) {
+            grain = std::max<size_t>(64, total / (8 * size()));
+        }
+        if (workers.empty() || insideJob() || total <= grain) {
+            fn(begin, end);
+            return;
+        }
+
+        std::lock_guard<std::mutex> submit(submitMutex);
+        Job job;
+        job.next = begin;
+        job.end = end;
+        job.grain = grain;
+        job.body = [&fn](size_t chunkBegin, size_t chunkEnd) { fn(chunkBegin, chunkEnd); };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = &job;
+            generation++;
+        }
+        wake.notify_all();
+        run(job);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        current = nullptr;
+        finished.wait(lock, [&job]() { return job.helpers == 0; });
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+    }
+
+private:
+    struct Job {
+        std::atomic<size_t> next{0};
+        size_t end = 0;
+        size_t grain = 1;
+        size_t helpers = 0;                 // workers still inside this job, guarded by mutex
+        std::function<void(size_t, size_t)> body;
+        std::mutex errorMutex;
+        std::exception_ptr error;           // first exception thrown by body
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex submitMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    Job* current = nullptr;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    static bool& insideJob() {
+        static thread_local bool inside = false;
+        return inside;
+    }
+
+    static void run(Job& job) {
+        bool wasInside = insideJob();
+        insideJob() = true;
+        try {
+            for (;;) {
+                size_t chunkBegin = job.next.fetch_add(job.grain, std::memory_order_relaxed);
+                if (chunkBegin >= job.end) {
+                    break;
+                }
+                job.body(chunkBegin, std::min(job.end, chunkBegin + job.grain));
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job.errorMutex);
+            if (!job.error) {
+                job.error = std::current_exception();
+            }
+            // Nobody starts the chunks that are left
+            job.next.store(job.end, std::memory_order_relaxed);
+        }
+        insideJob() = wasInside;
+    }
+
+    void workerLoop() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [&]() { return stopping || (current && generation != seen); });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            Job* job = current;
+            job->helpers++;
+            lock.unlock();
+            run(*job);
+            lock.lock();
+            if (--job->helpers == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+// One value per vertex. Algorithms keep one array per field (structure of
+// arrays) so a pass streams only the fields it touches; the relaxed atomic
+// accessors allow concurrent updates without wrapping every element in
+// std::atomic.
+template <typename T>
+struct VertexArray {
+    std::vector<T, AlignedAllocator<T, MemoryCategory::Workspaces>> values;
+
+    VertexArray() = default;
+    explicit VertexArray(size_t n, T initial = T()) : values(n, initial) {}
+
+    size_t size() const { return values.size(); }
+    T& operator[](size_t v) { return values[v]; }
+    const T& operator[](size_t v) const { return values[v]; }
+
+    T load(size_t v) const { return __atomic_load_n(&values[v], __ATOMIC_RELAXED); }
+    void store(size_t v, T value) { __atomic_store_n(&values[v], value, __ATOMIC_RELAXED); }
+    T fetchAdd(size_t v, T delta) { return __atomic_fetch_add(&values[v], delta, __ATOMIC_RELAXED); }
+
+    bool compareExchange(size_t v, T expected, T desired) {
+        return __atomic_compare_exchange_n(&values[v], &expected, desired, false,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    // Lower the value to at most `value`; returns the value seen before
+    T fetchMin(size_t v, T value) {
+        T seen = load(v);
+        while (value < seen &&
+               !__atomic_compare_exchange_n(&values[v], &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+        return seen;
+    }
+};
+
+// Set of vertices held either as a list (sparse) or as one flag per vertex
+// (dense); edgeMap converts between the two as the frontier grows and shrinks
+class VertexSubset {
+public:
+    explicit VertexSubset(size_t universeSize = 0) : universe(universeSize) {}
+
+    static VertexSubset all(size_t n) {
+        VertexSubset subset(n);
+        subset.dense = true;
+        subset.flags.assign(n, 1);
+        subset.count = n;
+        return subset;
+    }
+
+    static VertexSubset fromVertices(size_t n, std::vector<int> vertices) {
+        VertexSubset subset(n);
+        subset.count = vertices.size();
+        subset.list = std::move(vertices);
+        return subset;
+    }
+
+    static VertexSubset fromFlags(std::vector<uint8_t> vertexFlags, size_t memberCount) {
+        VertexSubset subset(vertexFlags.size());
+        subset.dense = true;
+        subset.flags = std::move(vertexFlags);
+        subset.count = memberCount;
+        return subset;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t universeSize() const { return universe; }
+    bool isDense() const { return dense; }
+
+    // Membership test; the subset must be dense
+    bool contains(int v) const { return flags[v] != 0; }
+
+    const std::vector<int>& vertices() const { return list; }
+
+    void toDense(ThreadPool& pool) {
+        if (dense) {
+            return;
+        }
+        flags.assign(universe, 0);
+        pool.parallelFor(0, list.size(), [this](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                flags[list[i]] = 1;
+            }
+        });
+        dense = true;
+        std::vector<int>().swap(list);
+    }
+
+    void toSparse(ThreadPool& pool) {
+        if (!dense) {
+            return;
+        }
+        std::mutex listMutex;
+        pool.parallelFor(0, universe, [&](size_t begin, size_t end) {
+            std::vector<int> local;
+            for (size_t v = begin; v < end; v++) {
+                if (flags[v]) {
+                    local.push_back(static_cast<int>(v));
+                }
+            }
+            std::lock_guard<std::mutex> lock(listMutex);
+            list.insert(list.end(), local.begin(), local.end());
+        });
+        dense = false;
+        std::vector<uint8_t>().swap(flags);
+    }
+
+private:
+    size_t universe = 0;
+    size_t count = 0;
+    bool dense = false;
+    std::vector<int> list;
+    std::vector<uint8_t> flags;
+};
+
+// Apply fn(v) to every member of the subset in parallel
+template <typename Fn>
+void vertexMap(const VertexSubset& subset, Fn fn, ThreadPool& pool = ThreadPool::shared()) {
+    if (subset.isDense()) {
+        pool.parallelFor(0, subset.universeSize(), [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                if (subset.contains(static_cast<int>(v))) {
+                    fn(static_cast<int>(v));
+                }
+            }
+        });
+    } else {
+        const std::vector<int>& members = subset.vertices();
+        pool.parallelFor(0, members.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                fn(members[i]);
+            }
+        });
+    }
+}
+
+// Members for which keep(v) returns true, as a sparse subset
+template <typename Fn>
+VertexSubset vertexFilter(const VertexSubset& subset, Fn keep, ThreadPool& pool = ThreadPool::shared()) {
+    std::mutex keptMutex;
+    std::vector<int> kept;
+    auto collect = [&](std::vector<int>& local) {
+        std::lock_guard<std::mutex> lock(keptMutex);
+        kept.insert(kept.end(), local.begin(), local.end());
+    };
+    if (subset.isDense()) {
+        pool.parallelFor(0, subset.universeSize(), [&](size_t begin, size_t end) {
+            std::vector<int> local;
+            for (size_t v = begin; v < end; v++) {
+                if (subset.contains(static_cast<int>(v)) && keep(static_cast<int>(v))) {
+                    local.push_back(static_cast<int>(v));
+                }
+            }
+            collect(local);
+        });
+    } else {
+        const std::vector<int>& members = subset.vertices();
+        pool.parallelFor(0, members.size(), [&](size_t begin, size_t end) {
+            std::vector<int> local;
+            for (size_t i = begin; i < end; i++) {
+                if (keep(members[i])) {
+                    local.push_back(members[i]);
+                }
+            }
+            collect(local);
+        });
+    }
+    return VertexSubset::fromVertices(subset.universeSize(), std::move(kept));
+}
+
+enum class EdgeMapMode {
+    Auto,                                   // pick per call from the frontier's edge count
+    Push,                                   // sparse: frontier vertices update their neighbours
+    Pull                                    // dense: every candidate scans its neighbours for frontier members
+};
+
+// Traverse the edges leaving a frontier and return the vertices whose update
+// reported true. The functor provides:
+//   bool cond(int target)                     - target still wants updates
+//   bool update(int source, int target)       - pull mode, target owned by the calling thread
+//   bool updateAtomic(int source, int target) - push mode, may race with other sources
+// Each returns true at most once per target for it to appear once in the
+// output. Auto switches to pull when the frontier touches more than
+// 1/denseDivisor of all edges, the direction-optimising rule of Ligra.
+template <typename F>
+VertexSubset edgeMap(const GraphSnapshot& graph, VertexSubset& frontier, F& f,
+                     EdgeMapMode mode = EdgeMapMode::Auto, ThreadPool& pool = ThreadPool::shared(),
+                     size_t denseDivisor = 20) {
+    size_t n = graph.vertexCount();
+    if (frontier.empty()) {
+        return VertexSubset(n);
+    }
+    if (mode == EdgeMapMode::Auto) {
+        std::atomic<size_t> touched(frontier.size());
+        if (frontier.isDense()) {
+            mode = EdgeMapMode::Pull;
+        } else {
+            const std::vector<int>& members = frontier.vertices();
+            pool.parallelFor(0, members.size(), [&](size_t begin, size_t end) {
+                size_t local = 0;
+                for (size_t i = begin; i < end; i++) {
+                    local += graph.degree(members[i]);
+                }
+                touched += local;
+            });
+            mode = touched.load() > graph.edgeCount() / denseDivisor ? EdgeMapMode::Pull : EdgeMapMode::Push;
+        }
+    }
+
+    if (mode == EdgeMapMode::Pull) {
+        frontier.toDense(pool);
+        std::vector<uint8_t> output(n, 0);
+        std::atomic<size_t> count(0);
+        pool.parallelFor(0, n, [&](size_t begin, size_t end) {
+            size_t local = 0;
+            for (size_t v = begin; v < end; v++) {
+                int target = static_cast<int>(v);
+                if (!f.cond(target)) {
+                    continue;
+                }
+                for (const int* it = graph.begin(target); it != graph.end(target); ++it) {
+                    if (frontier.contains(*it) && f.update(*it, target)) {
+                        output[v] = 1;
+                    }
+                    if (!f.cond(target)) {
+                        break;
+                    }
+                }
+                local += output[v];
+            }
+            count += local;
+        });
+        return VertexSubset::fromFlags(std::move(output), count.load());
+    }
+
+    frontier.toSparse(pool);
+    const std::vector<int>& members = frontier.vertices();
+    std::mutex outputMutex;
+    std::vector<int> output;
+    pool.parallelFor(0, members.size(), [&](size_t begin, size_t end) {
+        std::vector<int> local;
+        for (size_t i = begin; i < end; i++) {
+            int source = members[i];
+            for (const int* it = graph.begin(source); it != graph.end(source); ++it) {
+                if (f.cond(*it) && f.updateAtomic(source, *it)) {
+                    local.push_back(*it);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(outputMutex);
+        output.insert(output.end(), local.begin(), local.end());
+    });
+    return VertexSubset::fromVertices(n, std::move(output));
+}
+
+// FastRP parameters. Embeddings are the weighted sum of the normalised
+// random projection propagated over 1..iterationWeights.size() hops.
+struct FastRPConfig {
+    size_t dimension = 128;
+    double sparsity = 3.0;                  // projection entries are non-zero with probability 1/sparsity
+    double degreeExponent = 0.0;            // scales the initial projection by degree^exponent
+    std::vector<float> iterationWeights = {0.0f, 1.0f, 1.0f, 1.0f};
+    uint64_t seed = 42;
+};
+
+// Row-major embedding matrix; every row is padded with zeros to a multiple
+// of 16 floats so that each one starts on a 64-byte boundary.
+struct EmbeddingMatrix {
+    size_t rows = 0;
+    size_t dimension = 0;
+    size_t stride = 0;
+    FloatArray values;
+
+    void resize(size_t rowCount, size_t dim) {
+        rows = rowCount;
+        dimension = dim;
+        stride = (dim + 15) / 16 * 16;
+        values.assign(rows * stride, 0.0f);
+    }
+
+    float* row(size_t r) { return values.data() + r * stride; }
+    const float* row(size_t r) const { return values.data() + r * stride; }
+};
+
+inline void normalizeRow(float* row, size_t stride) {
+    float norm = std::sqrt(dotProduct(row, row, stride));
+    if (norm > 0.0f) {
+        float scale = 1.0f / norm;
+        for (size_t i = 0; i < stride; i++) {
+            row[i] *= scale;
+        }
+    }
+}
+
+// FastRP node embeddings: sparse random projection followed by repeated
+// multiplication with the random-walk matrix D^-1 A. Rows are processed in
+// parallel and every row operation is a contiguous multiply-add over floats.
+inline EmbeddingMatrix computeFastRP(const GraphSnapshot& snapshot, const FastRPConfig& config) {
+    size_t n = snapshot.vertexCount();
+    EmbeddingMatrix result;
+    EmbeddingMatrix current;
+    EmbeddingMatrix next;
+    result.resize(n, config.dimension);
+    current.resize(n, config.dimension);
+    next.resize(n, config.dimension);
+    size_t stride = result.stride;
+
+    // Very sparse random projection: +-sqrt(s) with probability 1/(2s) each
+    float magnitude = static_cast<float>(std::sqrt(config.sparsity));
+    double nonZero = 1.0 / config.sparsity;
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            std::mt19937_64 rng(mixBits(config.seed ^ mixBits(snapshot.ids[v])));
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            float scale = magnitude;
+            if (config.degreeExponent != 0.0 && snapshot.degree(static_cast<int>(v)) > 0) {
+                scale *= static_cast<float>(std::pow(
+                    static_cast<double>(snapshot.degree(static_cast<int>(v))), config.degreeExponent));
+            }
+            float* row = current.row(v);
+            for (size_t i = 0; i < config.dimension; i++) {
+                double draw = uniform(rng);
+                if (draw < nonZero / 2) {
+                    row[i] = scale;
+                } else if (draw < nonZero) {
+                    row[i] = -scale;
+                }
+            }
+        }
+    });
+
+    for (float weight : config.iterationWeights) {
+        parallelFor(0, n, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                float* target = next.row(v);
+                std::fill(target, target + stride, 0.0f);
+                size_t deg = snapshot.degree(static_cast<int>(v));
+                if (deg == 0) {
+                    continue;
+                }
+                for (const int* it = snapshot.begin(static_cast<int>(v));
+                     it != snapshot.end(static_cast<int>(v)); ++it) {
+                    const float* source = current.row(*it);
+                    for (size_t i = 0; i < stride; i++) {
+                        target[i] += source[i];
+                    }
+                }
+                float inverse = 1.0f / static_cast<float>(deg);
+                for (size_t i = 0; i < stride; i++) {
+                    target[i] *= inverse;
+                }
+
+                if (weight != 0.0f) {
+                    // Each hop contributes its L2-normalised projection
+                    float norm = std::sqrt(dotProduct(target, target, stride));
+                    if (norm > 0.0f) {
+                        float scale = weight / norm;
+                        float* out = result.row(v);
+                        for (size_t i = 0; i < stride; i++) {
+                            out[i] += target[i] * scale;
+                        }
+                    }
+                }
+            }
+        });
+        std::swap(current.values, next.values);
+    }
+
+    // Unit-length rows turn cosine similarity into a plain dot product
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            normalizeRow(result.row(v), stride);
+        }
+    });
+    return result;
+}
+
+// Hierarchical navigable small world graph over unit-length embeddings.
+// Distance is 1 - dot(a, b), i.e. cosine distance.
+class HnswIndex {
+public:
+    struct Config {
+        size_t maxLinks = 16;               // M: links per node on the upper layers
+        size_t efConstruction = 200;
+        size_t efSearch = 64;
+        uint64_t seed = 7;
+    };
+
+    HnswIndex() = default;
+
+    void build(EmbeddingMatrix matrix, const Config& indexConfig) {
+        config = indexConfig;
+        embeddings = std::move(matrix);
+        size_t n = embeddings.rows;
+        maxLinksLayer0 = config.maxLinks * 2;
+        levelMultiplier = 1.0 / std::log(static_cast<double>(std::max<size_t>(config.maxLinks, 2)));
+        levels.assign(n, 0);
+        layer0Links.assign(n * (maxLinksLayer0 + 1), 0);
+        upperLinks.assign(n, {});
+        entryPoint = -1;
+        maxLevel = -1;
+
+        std::mt19937_64 rng(config.seed);
+        std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+        for (size_t node = 0; node < n; node++) {
+            int level = static_cast<int>(-std::log(uniform(rng)) * levelMultiplier);
+            insert(static_cast<uint32_t>(node), level);
+        }
+    }
+
+    size_t size() const { return levels.size(); }
+    const EmbeddingMatrix& vectors() const { return embeddings; }
+
+    // Approximate k nearest neighbours of a query vector, closest first
+    std::vector<std::pair<uint32_t, float>> search(const float* query, size_t k, size_t ef) const {
+        std::vector<std::pair<uint32_t, float>> result;
+        if (entryPoint < 0) {
+            return result;
+        }
+        uint32_t current = static_cast<uint32_t>(entryPoint);
+        float currentDistance = distance(query, current);
+        for (int level = maxLevel; level > 0; level--) {
+            greedyDescend(query, current, currentDistance, level);
+        }
+
+        auto found = searchLayer(query, current, currentDistance, std::max(ef, k), 0);
+        result.reserve(std::min(k, found.size()));
+        for (size_t i = 0; i < found.size() && i < k; i++) {
+            result.push_back({found[i].second, found[i].first});
+        }
+        return result;
+    }
+
+private:
+    using Candidate = std::pair<float, uint32_t>;   // (distance, node)
+
+    Config config;
+    EmbeddingMatrix embeddings;
+    size_t maxLinksLayer0 = 32;
+    double levelMultiplier = 1.0;
+    CountedVector<int, MemoryCategory::Indexes> levels;
+    // Layer 0 is stored flat: for every node a count followed by maxLinksLayer0 slots
+    CountedVector<uint32_t, MemoryCategory::Indexes> layer0Links;
+    // Layers above 0, per node: upperLinks[node][level - 1]
+    using LinkList = CountedVector<uint32_t, MemoryCategory::Indexes>;
+    CountedVector<CountedVector<LinkList, MemoryCategory::Indexes>, MemoryCategory::Indexes> upperLinks;
+    int entryPoint = -1;
+    int maxLevel = -1;
+
+    float distance(const float* query, uint32_t node) const {
+        return 1.0f - dotProduct(query, embeddings.row(node), embeddings.stride);
+    }
+
+    float distance(uint32_t a, uint32_t b) const {
+        return distance(embeddings.row(a), b);
+    }
+
+    size_t linkCount(uint32_t node, int level) const {
+        if (level == 0) {
+            return layer0Links[node * (maxLinksLayer0 + 1)];
+        }
+        return upperLinks[node][level - 1].size();
+    }
+
+    const uint32_t* links(uint32_t node, int level) const {
+        if (level == 0) {
+            return layer0Links.data() + node * (maxLinksLayer0 + 1) + 1;
+        }
+        return upperLinks[node][level - 1].data();
+    }
+
+    void setLinks(uint32_t node, int level, const std::vector<uint32_t>& nodes) {
+        if (level == 0) {
+            uint32_t* slot = layer0Links.data() + node * (maxLinksLayer0 + 1);
+            slot[0] = static_cast<uint32_t>(nodes.size());
+            std::copy(nodes.begin(), nodes.end(), slot + 1);
+        } else {
+            upperLinks[node][level - 1].assign(nodes.begin(), nodes.end());
+        }
+    }
+
+    void greedyDescend(const float* query, uint32_t& current, float& currentDistance, int level) const {
+        bool improved = true;
+        while (improved) {
+            improved = false;
+            const uint32_t* neighbors = links(current, level);
+            size_t count = linkCount(current, level);
+            for (size_t i = 0; i < count; i++) {
+                float d = distance(query, neighbors[i]);
+                if (d < currentDistance) {
+                    currentDistance = d;
+                    current = neighbors[i];
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    // Beam search on one layer, returns up to ef candidates sorted by distance
+    std::vector<Candidate> searchLayer(const float* query, uint32_t entry, float entryDistance,
+                                       size_t ef, int level) const {
+        std::unordered_set<uint32_t> visited;
+        visited.reserve(ef * 4);
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+        std::priority_queue<Candidate> best;
+
+        visited.insert(entry);
+        candidates.push({entryDistance, entry});
+        best.push({entryDistance, entry});
+
+        while (!candidates.empty()) {
+            Candidate closest = candidates.top();
+            if (closest.first > best.top().first && best.size() >= ef) {
+                break;
+            }
+            candidates.pop();
+
+            const uint32_t* neighbors = links(closest.second, level);
+            size_t count = linkCount(closest.second, level);
+            for (size_t i = 0; i < count; i++) {
+                uint32_t neighbor = neighbors[i];
+                if (!visited.insert(neighbor).second) {
+                    continue;
+                }
+                float d = distance(query, neighbor);
+                if (best.size() < ef || d < best.top().first) {
+                    candidates.push({d, neighbor});
+                    best.push({d, neighbor});
+                    if (best.size() > ef) {
+                        best.pop();
+                    }
+                }
+            }
+        }
+
+        std::vector<Candidate> result;
+        result.reserve(best.size());
+        while (!best.empty()) {
+            result.push_back(best.top());
+            best.pop();
+        }
+        std::reverse(result.begin(), result.end());
+        return result;
+    }
+
+    // Neighbour selection heuristic: keep a candidate only if it is closer to
+    // the base node than to every neighbour already kept
+    std::vector<uint32_t> selectNeighbors(const std::vector<Candidate>& sorted, size_t limit) const {
+        std::vector<uint32_t> selected;
+        for (const auto& candidate : sorted) {
+            if (selected.size() >= limit) {
+                break;
+            }
+            bool diverse = true;
+            for (uint32_t kept : selected) {
+                if (distance(candidate.second, kept) < candidate.first) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) {
+                selected.push_back(candidate.second);
+            }
+        }
+        return selected;
+    }
+
+    void connect(uint32_t node, uint32_t neighbor, int level) {
+        size_t limit = level == 0 ? maxLinksLayer0 : config.maxLinks;
+        size_t count = linkCount(neighbor, level);
+        std::vector<uint32_t> current(links(neighbor, level), links(neighbor, level) + count);
+        if (count < limit) {
+            current.push_back(node);
+            setLinks(neighbor, level, current);
+            return;
+        }
+
+        // Neighbour list is full: re-run the heuristic over the old links plus the new one
+        std::vector<Candidate> pool;
+        pool.reserve(count + 1);
+        pool.push_back({distance(neighbor, node), node});
+        for (uint32_t existing : current) {
+            pool.push_back({distance(neighbor, existing), existing});
+        }
+        std::sort(pool.begin(), pool.end());
+        setLinks(neighbor, level, selectNeighbors(pool, limit));
+    }
+
+    void insert(uint32_t node, int level) {
+        levels[node] = level;
+        upperLinks[node].assign(static_cast<size_t>(level), {});
+        if (entryPoint < 0) {
+            entryPoint = static_cast<int>(node);
+            maxLevel = level;
+            return;
+        }
+
+        const float* query = embeddings.row(node);
+        uint32_t current = static_cast<uint32_t>(entryPoint);
+        float currentDistance = distance(query, current);
+        for (int l = maxLevel; l > level; l--) {
+            greedyDescend(query, current, currentDistance, l);
+        }
+
+        for (int l = std::min(level, maxLevel); l >= 0; l--) {
+            auto found = searchLayer(query, current, currentDistance, config.efConstruction, l);
+            size_t limit = l == 0 ? maxLinksLayer0 : config.maxLinks;
+            std::vector<uint32_t> selected = selectNeighbors(found, limit);
+            setLinks(node, l, selected);
+            for (uint32_t neighbor : selected) {
+                connect(node, neighbor, l);
+            }
+            current = found.front().second;
+            currentDistance = found.front().first;
+        }
+
+        if (level > maxLevel) {
+            maxLevel = level;
+            entryPoint = static_cast<int>(node);
+        }
+    }
+};
+
+// Marks each target once per round; the edge functor behind frontier
+// activation in the vertex-centric passes
+struct ActivateOnce {
+    VertexArray<uint8_t>& queued;
+
+    bool cond(int target) const { return queued.load(target) == 0; }
+    bool update(int, int target) {
+        queued.store(target, 1);
+        return true;
+    }
+    bool updateAtomic(int, int target) { return queued.compareExchange(target, 0, 1); }
+};
+
+// Parallel asynchronous label propagation on the vertex-centric framework.
+// Every active vertex adopts the most frequent label among its neighbours
+// (keeping its own label on ties); updates from other threads become visible
+// immediately, which damps the oscillations of the synchronous variant. The
+// neighbours of vertices that changed form the next round's frontier.
+inline std::vector<int32_t> labelPropagation(const GraphSnapshot& snapshot, size_t maxIterations = 50) {
+    size_t n = snapshot.vertexCount();
+    VertexArray<int32_t> labels(n);
+    VertexArray<uint8_t> queued(n, 0);
+    for (size_t v = 0; v < n; v++) {
+        labels[v] = static_cast<int32_t>(v);
+    }
+
+    VertexSubset frontier = VertexSubset::all(n);
+    size_t stopBelow = std::max<size_t>(1, n / 100000);
+    for (size_t iteration = 0; iteration < maxIterations && !frontier.empty(); iteration++) {
+        VertexSubset changed = vertexFilter(frontier, [&](int v) {
+            if (snapshot.degree(v) == 0) {
+                return false;
+            }
+            thread_local std::vector<int32_t> seen;
+            seen.clear();
+            for (const int* it = snapshot.begin(v); it != snapshot.end(v); ++it) {
+                seen.push_back(labels.load(*it));
+            }
+            std::sort(seen.begin(), seen.end());
+
+            int32_t own = labels.load(v);
+            int32_t best = own;
+            size_t bestCount = 0;
+            size_t ownCount = 0;
+            for (size_t i = 0; i < seen.size();) {
+                size_t j = i;
+                while (j < seen.size() && seen[j] == seen[i]) {
+                    j++;
+                }
+                if (seen[i] == own) {
+                    ownCount = j - i;
+                }
+                if (j - i > bestCount) {
+                    bestCount = j - i;
+                    best = seen[i];
+                }
+                i = j;
+            }
+            if (best != own && bestCount > ownCount) {
+                labels.store(v, best);
+                return true;
+            }
+            return false;
+        });
+        if (changed.size() < stopBelow) {
+            break;
+        }
+
+        ActivateOnce activate{queued};
+        frontier = edgeMap(snapshot, changed, activate);
+        vertexMap(frontier, [&queued](int v) { queued.store(v, 0); });
+    }
+    return std::vector<int32_t>(labels.values.begin(), labels.values.end());
+}
+
+// Weighted undirected graph used between Louvain levels. Each edge is stored
+// in both directions; a self loop carries twice the internal weight of the
+// community it replaces, so vertex strengths are preserved by aggregation.
+struct WeightedGraph {
+    std::vector<size_t> offsets;
+    std::vector<int> targets;
+    std::vector<double> weights;
+
+    size_t vertexCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
+
+// Parallel Louvain modularity optimisation. The local-moving phase evaluates
+// all vertices concurrently against the community totals of the previous
+// sweep; a singleton only joins another singleton with a smaller id, which
+// prevents two vertices from endlessly swapping places.
+inline std::vector<int32_t> louvain(const GraphSnapshot& snapshot, size_t maxLevels = 10,
+                                    size_t maxSweeps = 20, double minGain = 1e-6) {
+    size_t n = snapshot.vertexCount();
+    std::vector<int32_t> membership(n);
+    for (size_t v = 0; v < n; v++) {
+        membership[v] = static_cast<int32_t>(v);
+    }
+
+    WeightedGraph level;
+    level.offsets.assign(snapshot.offsets.begin(), snapshot.offsets.end());
+    level.targets.assign(snapshot.neighbors.begin(), snapshot.neighbors.end());
+    level.weights.assign(snapshot.neighbors.size(), 1.0);
+
+    for (size_t depth = 0; depth < maxLevels; depth++) {
+        size_t count = level.vertexCount();
+        std::vector<double> strength(count, 0.0);
+        double totalWeight = 0.0;
+        for (size_t v = 0; v < count; v++) {
+            for (size_t e = level.offsets[v]; e < level.offsets[v + 1]; e++) {
+                strength[v] += level.weights[e];
+            }
+            totalWeight += strength[v];
+        }
+        if (totalWeight == 0.0) {
+            break;
+        }
+
+        std::vector<int32_t> community(count);
+        std::vector<double> communityTotal(strength);
+        std::vector<size_t> communitySize(count, 1);
+        for (size_t v = 0; v < count; v++) {
+            community[v] = static_cast<int32_t>(v);
+        }
+
+        auto modularity = [&]() {
+            std::vector<double> internal(count, 0.0);
+            for (size_t v = 0; v < count; v++) {
+                for (size_t e = level.offsets[v]; e < level.offsets[v + 1]; e++) {
+                    if (community[level.targets[e]] == community[v]) {
+                        internal[community[v]] += level.weights[e];
+                    }
+                }
+            }
+            double q = 0.0;
+            for (size_t c = 0; c < count; c++) {
+                double share = communityTotal[c] / totalWeight;
+                q += internal[c] / totalWeight - share * share;
+            }
+            return q;
+        };
+
+        double quality = modularity();
+        bool movedAny = false;
+        for (size_t sweep = 0; sweep < maxSweeps; sweep++) {
+            std::vector<int32_t> proposal(community);
+            parallelFor(0, count, [&](size_t begin, size_t end) {
+                std::unordered_map<int32_t, double> links;
+                for (size_t v = begin; v < end; v++) {
+                    links.clear();
+                    int32_t own = community[v];
+                    for (size_t e = level.offsets[v]; e < level.offsets[v + 1]; e++) {
+                        if (static_cast<size_t>(level.targets[e]) != v) {
+                            links[community[level.targets[e]]] += level.weights[e];
+                        }
+                    }
+
+                    // Gain of joining c, relative to sitting alone: links(c) - tot(c) * k / 2m
+                    double k = strength[v];
+                    double ownLinks = links.count(own) ? links[own] : 0.0;
+                    double bestGain = ownLinks - (communityTotal[own] - k) * k / totalWeight;
+                    int32_t best = own;
+                    for (const auto& entry : links) {
+                        if (entry.first == own) {
+                            continue;
+                        }
+                        double gain = entry.second - communityTotal[entry.first] * k / totalWeight;
+                        if (gain > bestGain ||
+                            (gain == bestGain && best != own && entry.first < best)) {
+                            bestGain = gain;
+                            best = entry.first;
+                        }
+                    }
+                    if (best != own && communitySize[own] == 1 && communitySize[best] == 1 && best > own) {
+                        best = own;
+                    }
+                    proposal[v] = best;
+                }
+            });
+
+            community.swap(proposal);
+            std::fill(communityTotal.begin(), communityTotal.end(), 0.0);
+            std::fill(communitySize.begin(), communitySize.end(), 0);
+            for (size_t v = 0; v < count; v++) {
+                communityTotal[community[v]] += strength[v];
+                communitySize[community[v]]++;
+            }
+
+            double updated = modularity();
+            if (updated - quality < minGain) {
+                if (updated < quality) {
+                    community.swap(proposal);
+                    std::fill(communityTotal.begin(), communityTotal.end(), 0.0);
+                    std::fill(communitySize.begin(), communitySize.end(), 0);
+                    for (size_t v = 0; v < count; v++) {
+                        communityTotal[community[v]] += strength[v];
+                        communitySize[community[v]]++;
+                    }
+                }
+                break;
+            }
+            quality = updated;
+            movedAny = true;
+        }
+        if (!movedAny) {
+            break;
+        }
+
+        // Renumber communities densely and fold them into the next level
+        std::vector<int32_t> renumber(count, -1);
+        int32_t communities = 0;
+        for (size_t v = 0; v < count; v++) {
+            if (renumber[community[v]] < 0) {
+                renumber[community[v]] = communities++;
+            }
+        }
+        for (size_t v = 0; v < n; v++) {
+            membership[v] = renumber[community[membership[v]]];
+        }
+
+        std::vector<std::vector<int>> members(communities);
+        for (size_t v = 0; v < count; v++) {
+            members[renumber[community[v]]].push_back(static_cast<int>(v));
+        }
+        std::vector<std::vector<std::pair<int, double>>> rows(communities);
+        parallelFor(0, static_cast<size_t>(communities), [&](size_t begin, size_t end) {
+            std::unordered_map<int, double> merged;
+            for (size_t c = begin; c < end; c++) {
+                merged.clear();
+                for (int v : members[c]) {
+                    for (size_t e = level.offsets[v]; e < level.offsets[v + 1]; e++) {
+                        merged[renumber[community[level.targets[e]]]] += level.weights[e];
+                    }
+                }
+                rows[c].assign(merged.begin(), merged.end());
+                std::sort(rows[c].begin(), rows[c].end());
+            }
+        });
+
+        WeightedGraph next;
+        next.offsets.assign(communities + 1, 0);
+        for (int32_t c = 0; c < communities; c++) {
+            next.offsets[c + 1] = next.offsets[c] + rows[c].size();
+        }
+        next.targets.reserve(next.offsets[communities]);
+        next.weights.reserve(next.offsets[communities]);
+        for (int32_t c = 0; c < communities; c++) {
+            for (const auto& edge : rows[c]) {
+                next.targets.push_back(edge.first);
+                next.weights.push_back(edge.second);
+            }
+        }
+        if (static_cast<size_t>(communities) == count) {
+            break;
+        }
+        level = std::move(next);
+    }
+    return membership;
+}
+
+enum class CommunityAlgorithm { LabelPropagation, Louvain };
+
+// Community id per user, stored as a compact array next to the user ids.
+// Users that join after detection are appended by the incremental updates.
+struct CommunityAssignment {
+    CountedVector<int, MemoryCategory::Indexes> ids;          // slot -> user id
+    CountedMap<int, int, MemoryCategory::Indexes> slotOf;     // user id -> slot
+    CountedVector<int32_t, MemoryCategory::Indexes> community;  // slot -> community id
+    int32_t communityCount = 0;
+
+    bool empty() const { return ids.empty(); }
+
+    // Community of a user, or -1 if the user has not been assigned one
+    int32_t communityOf(int userId) const {
+        auto it = slotOf.find(userId);
+        return it == slotOf.end() ? -1 : community[it->second];
+    }
+};
+
+// Intersect two strictly increasing arrays, calling onMatch(i, j) for every
+// a[i] == b[j]. With SSE2 the arrays are compared four-by-four: each block of
+// a is tested against all rotations of the block of b in one pass.
+template <typename Fn>
+inline void intersectSorted(const int* a, size_t sizeA, const int* b, size_t sizeB, Fn onMatch) {
+    size_t i = 0;
+    size_t j = 0;
+#if defined(__SSE2__)
+    while (i + 4 <= sizeA && j + 4 <= sizeB) {
+        __m128i blockA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i blockB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        __m128i equal = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, blockB),
+                         _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(blockA, _mm_shuffle_epi32(blockB, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(equal));
+        while (mask != 0) {
+            int lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            for (size_t k = 0; k < 4; k++) {
+                if (b[j + k] == a[i + lane]) {
+                    onMatch(i + lane, j + k);
+                    break;
+                }
+            }
+        }
+        int lastA = a[i + 3];
+        int lastB = b[j + 3];
+        if (lastA <= lastB) {
+            i += 4;
+        }
+        if (lastB <= lastA) {
+            j += 4;
+        }
+    }
+#endif
+    while (i < sizeA && j < sizeB) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (b[j] < a[i]) {
+            j++;
+        } else {
+            onMatch(i, j);
+            i++;
+            j++;
+        }
+    }
+}
+
+// Triangle statistics of a snapshot. embeddedness[e] is the number of
+// triangles through the edge stored at slot e of snapshot->neighbors, so it
+// can be read alongside the adjacency without any lookup structure.
+struct TriangleIndex {
+    std::shared_ptr<const GraphSnapshot> snapshot;
+    CountedVector<uint32_t, MemoryCategory::Indexes> embeddedness;  // per adjacency slot
+    CountedVector<float, MemoryCategory::Indexes> clustering;       // per vertex local clustering coefficient
+    uint64_t triangleCount = 0;
+
+    bool empty() const { return !snapshot; }
+
+    // Slot of edge (vertex, neighbor) in the adjacency, or -1
+    long long slotOf(int vertex, int neighbor) const {
+        const int* first = snapshot->begin(vertex);
+        const int* last = snapshot->end(vertex);
+        const int* it = std::lower_bound(first, last, neighbor);
+        return it != last && *it == neighbor ? static_cast<long long>(it - snapshot->neighbors.data()) : -1;
+    }
+
+    // Neighbourhood overlap of an edge: shared friends over the union of the
+    // endpoints' other friends. 0 for edges unknown to the snapshot.
+    double overlap(int userId1, int userId2) const {
+        if (empty()) {
+            return 0.0;
+        }
+        int u = snapshot->vertexOf(userId1);
+        int v = snapshot->vertexOf(userId2);
+        if (u < 0 || v < 0) {
+            return 0.0;
+        }
+        long long slot = slotOf(u, v);
+        if (slot < 0) {
+            return 0.0;
+        }
+        double shared = embeddedness[slot];
+        double others = static_cast<double>(snapshot->degree(u) + snapshot->degree(v)) - 2.0 - shared;
+        return others > 0.0 ? shared / others : 0.0;
+    }
+};
+
+// Parallel triangle listing. Edges are oriented from lower to higher
+// (degree, id) rank so every out-list is short, each triangle is found
+// exactly once from its lowest-ranked vertex, and the counts of its three
+// edges are bumped before being mirrored onto the reverse slots.
+inline TriangleIndex countTriangles(std::shared_ptr<const GraphSnapshot> snapshotPtr) {
+    const GraphSnapshot& graph = *snapshotPtr;
+    size_t n = graph.vertexCount();
+    auto ranksBelow = [&graph](int u, int v) {
+        size_t du = graph.degree(u);
+        size_t dv = graph.degree(v);
+        return du < dv || (du == dv && u < v);
+    };
+
+    // Oriented adjacency; outSlots keeps the slot of each edge in the full CSR
+    std::vector<size_t> outOffsets(n + 1, 0);
+    for (size_t u = 0; u < n; u++) {
+        size_t count = 0;
+        for (const int* it = graph.begin(static_cast<int>(u)); it != graph.end(static_cast<int>(u)); ++it) {
+            count += ranksBelow(static_cast<int>(u), *it);
+        }
+        outOffsets[u + 1] = outOffsets[u] + count;
+    }
+    std::vector<int> outTargets(outOffsets[n]);
+    std::vector<size_t> outSlots(outOffsets[n]);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t u = begin; u < end; u++) {
+            size_t position = outOffsets[u];
+            for (size_t e = graph.offsets[u]; e < graph.offsets[u + 1]; e++) {
+                if (ranksBelow(static_cast<int>(u), graph.neighbors[e])) {
+                    outTargets[position] = graph.neighbors[e];
+                    outSlots[position] = e;
+                    position++;
+                }
+            }
+        }
+    });
+
+    std::vector<std::atomic<uint32_t>> counts(graph.edgeCount());
+    for (auto& count : counts) {
+        count.store(0, std::memory_order_relaxed);
+    }
+    std::atomic<uint64_t> total(0);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        uint64_t local = 0;
+        for (size_t u = begin; u < end; u++) {
+            const int* outU = outTargets.data() + outOffsets[u];
+            size_t sizeU = outOffsets[u + 1] - outOffsets[u];
+            for (size_t a = 0; a < sizeU; a++) {
+                int v = outU[a];
+                const int* outV = outTargets.data() + outOffsets[v];
+                size_t sizeV = outOffsets[v + 1] - outOffsets[v];
+                size_t slotUV = outSlots[outOffsets[u] + a];
+                intersectSorted(outU, sizeU, outV, sizeV, [&](size_t i, size_t j) {
+                    counts[slotUV].fetch_add(1, std::memory_order_relaxed);
+                    counts[outSlots[outOffsets[u] + i]].fetch_add(1, std::memory_order_relaxed);
+                    counts[outSlots[outOffsets[v] + j]].fetch_add(1, std::memory_order_relaxed);
+                    local++;
+                });
+            }
+        }
+        total += local;
+    });
+
+    TriangleIndex result;
+    result.snapshot = snapshotPtr;
+    result.triangleCount = total.load();
+    result.embeddedness.assign(graph.edgeCount(), 0);
+    result.clustering.assign(n, 0.0f);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t u = begin; u < end; u++) {
+            uint64_t trianglesAtU = 0;
+            for (size_t e = graph.offsets[u]; e < graph.offsets[u + 1]; e++) {
+                int v = graph.neighbors[e];
+                // The count lives on the slot owned by the lower-ranked endpoint
+                size_t owner = e;
+                if (!ranksBelow(static_cast<int>(u), v)) {
+                    owner = static_cast<size_t>(std::lower_bound(graph.begin(v), graph.end(v), static_cast<int>(u))
+                                                - graph.neighbors.data());
+                }
+                result.embeddedness[e] = counts[owner].load(std::memory_order_relaxed);
+                trianglesAtU += result.embeddedness[e];
+            }
+            double degree = static_cast<double>(graph.degree(static_cast<int>(u)));
+            if (degree > 1) {
+                // Every triangle at u is seen through two of its edges
+                result.clustering[u] = static_cast<float>(trianglesAtU / (degree * (degree - 1)));
+            }
+        }
+    });
+    return result;
+}
+
+// Linear-time k-core decomposition (Batagelj and Zaversnik): vertices sit in
+// buckets by current degree and are peeled in ascending order, moving each
+// affected neighbour down one bucket in O(1).
+inline std::vector<int32_t> coreDecomposition(const GraphSnapshot& graph) {
+    size_t n = graph.vertexCount();
+    std::vector<int32_t> degree(n);
+    size_t maxDegree = 0;
+    for (size_t v = 0; v < n; v++) {
+        degree[v] = static_cast<int32_t>(graph.degree(static_cast<int>(v)));
+        maxDegree = std::max(maxDegree, static_cast<size_t>(degree[v]));
+    }
+
+    // bucketStart[d] is the first position of degree-d vertices in order
+    std::vector<size_t> bucketStart(maxDegree + 2, 0);
+    for (size_t v = 0; v < n; v++) {
+        bucketStart[degree[v] + 1]++;
+    }
+    for (size_t d = 1; d < bucketStart.size(); d++) {
+        bucketStart[d] += bucketStart[d - 1];
+    }
+    std::vector<int> order(n);
+    std::vector<size_t> position(n);
+    {
+        std::vector<size_t> next(bucketStart.begin(), bucketStart.end() - 1);
+        for (size_t v = 0; v < n; v++) {
+            position[v] = next[degree[v]]++;
+            order[position[v]] = static_cast<int>(v);
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        int v = order[i];
+        for (const int* it = graph.begin(v); it != graph.end(v); ++it) {
+            int u = *it;
+            if (degree[u] > degree[v]) {
+                // Swap u with the first vertex of its bucket, then shrink the bucket
+                int32_t du = degree[u];
+                size_t first = bucketStart[du];
+                int w = order[first];
+                if (u != w) {
+                    std::swap(order[position[u]], order[first]);
+                    std::swap(position[u], position[w]);
+                }
+                bucketStart[du]++;
+                degree[u]--;
+            }
+        }
+    }
+    return degree;
+}
+
+// Parallel k-core decomposition by level-synchronous peeling on the
+// vertex-centric framework. At level k all remaining vertices of degree <= k
+// are removed together; a neighbour whose degree falls from k + 1 to k joins
+// the next sub-round of the same level.
+inline std::vector<int32_t> parallelCoreDecomposition(const GraphSnapshot& graph) {
+    size_t n = graph.vertexCount();
+    VertexArray<int32_t> degree(n);
+    VertexArray<int32_t> core(n, 0);
+    VertexArray<uint8_t> removed(n, 0);
+    for (size_t v = 0; v < n; v++) {
+        degree[v] = static_cast<int32_t>(graph.degree(static_cast<int>(v)));
+    }
+
+    // Edge functor: peeling a source takes one from each surviving neighbour
+    struct Peel {
+        VertexArray<int32_t>& degree;
+        VertexArray<uint8_t>& removed;
+        int32_t level;
+
+        bool cond(int target) const { return removed.load(target) == 0; }
+        bool update(int, int target) {
+            int32_t before = degree.load(target);
+            degree.store(target, before - 1);
+            return before == level + 1;
+        }
+        bool updateAtomic(int, int target) { return degree.fetchAdd(target, -1) == level + 1; }
+    };
+
+    VertexSubset remaining = VertexSubset::all(n);
+    int32_t level = 0;
+    while (!remaining.empty()) {
+        VertexSubset frontier = vertexFilter(remaining, [&](int v) { return degree.load(v) <= level; });
+        while (!frontier.empty()) {
+            vertexMap(frontier, [&](int v) {
+                core[v] = level;
+                removed.store(v, 1);
+            });
+            Peel peel{degree, removed, level};
+            frontier = edgeMap(graph, frontier, peel);
+        }
+        remaining = vertexFilter(remaining, [&](int v) { return removed.load(v) == 0; });
+        level++;
+    }
+    return std::vector<int32_t>(core.values.begin(), core.values.end());
+}
+
+// Connected components by minimum-label propagation on the vertex-centric
+// framework: every vertex starts with its own index and repeatedly takes the
+// smallest label of a neighbour until no label changes. The result labels
+// each vertex with the smallest vertex index of its component.
+inline std::vector<int32_t> connectedComponents(const GraphSnapshot& graph) {
+    size_t n = graph.vertexCount();
+    VertexArray<int32_t> label(n);
+    VertexArray<int32_t> previous(n);
+    for (size_t v = 0; v < n; v++) {
+        label[v] = static_cast<int32_t>(v);
+        previous[v] = static_cast<int32_t>(v);
+    }
+
+    // Edge functor: a target is reported only by the update that first lowers
+    // its label in this round
+    struct MinLabel {
+        VertexArray<int32_t>& label;
+        VertexArray<int32_t>& previous;
+
+        bool cond(int) const { return true; }
+        bool update(int source, int target) {
+            int32_t candidate = label.load(source);
+            int32_t current = label.load(target);
+            if (candidate >= current) {
+                return false;
+            }
+            label.store(target, candidate);
+            return current == previous[target];
+        }
+        bool updateAtomic(int source, int target) {
+            int32_t candidate = label.load(source);
+            int32_t before = label.fetchMin(target, candidate);
+            return candidate < before && before == previous[target];
+        }
+    };
+
+    VertexSubset frontier = VertexSubset::all(n);
+    while (!frontier.empty()) {
+        MinLabel minLabel{label, previous};
+        frontier = edgeMap(graph, frontier, minLabel);
+        vertexMap(frontier, [&](int v) { previous[v] = label.load(v); });
+    }
+    return std::vector<int32_t>(label.values.begin(), label.values.end());
+}
+
+// PageRank parameters
+struct PageRankConfig {
+    double damping = 0.85;
+    double tolerance = 1e-6;                // stop once an iteration changes the ranks by less (L1)
+    size_t maxIterations = 100;
+};
+
+// Pull-based PageRank. Each iteration first writes every vertex's outgoing
+// share rank / degree into a contiguous contribution array (a vectorisable
+// multiply by precomputed inverse degrees), then every vertex sums the
+// contributions of its neighbours. The mass of isolated vertices is spread
+// uniformly. If rank already holds one value per vertex it seeds the
+// iteration (warm start); it is renormalised to sum to one first. Returns
+// the number of iterations run.
+inline size_t pageRank(const GraphSnapshot& graph, const PageRankConfig& config, FloatArray& rank) {
+    size_t n = graph.vertexCount();
+    if (n == 0) {
+        rank.clear();
+        return 0;
+    }
+    ThreadPool& pool = ThreadPool::shared();
+    float uniform = 1.0f / static_cast<float>(n);
+    if (rank.size() != n) {
+        rank.assign(n, uniform);
+    } else {
+        double total = 0.0;
+        for (float& value : rank) {
+            value = value > 0.0f ? value : uniform;
+            total += value;
+        }
+        for (float& value : rank) {
+            value = static_cast<float>(value / total);
+        }
+    }
+
+    ScratchFloatArray inverseDegree(n);
+    for (size_t v = 0; v < n; v++) {
+        size_t degree = graph.degree(static_cast<int>(v));
+        inverseDegree[v] = degree == 0 ? 0.0f : 1.0f / static_cast<float>(degree);
+    }
+    ScratchFloatArray contribution(n);
+    FloatArray next(n);
+    std::mutex sumMutex;
+
+    size_t iteration = 0;
+    while (iteration < config.maxIterations) {
+        iteration++;
+        double dangling = 0.0;
+        pool.parallelFor(0, n, [&](size_t begin, size_t end) {
+            const float* r = rank.data();
+            const float* inv = inverseDegree.data();
+            float* c = contribution.data();
+            for (size_t v = begin; v < end; v++) {
+                c[v] = r[v] * inv[v];
+            }
+            double localDangling = 0.0;
+            for (size_t v = begin; v < end; v++) {
+                localDangling += inv[v] == 0.0f ? r[v] : 0.0f;
+            }
+            std::lock_guard<std::mutex> lock(sumMutex);
+            dangling += localDangling;
+        });
+
+        float base = static_cast<float>((1.0 - config.damping + config.damping * dangling) / n);
+        float damping = static_cast<float>(config.damping);
+        double change = 0.0;
+        pool.parallelFor(0, n, [&](size_t begin, size_t end) {
+            double localChange = 0.0;
+            for (size_t v = begin; v < end; v++) {
+                float sum = 0.0f;
+                for (const int* it = graph.begin(static_cast<int>(v)); it != graph.end(static_cast<int>(v)); ++it) {
+                    sum += contribution[*it];
+                }
+                next[v] = base + damping * sum;
+                localChange += std::fabs(next[v] - rank[v]);
+            }
+            std::lock_guard<std::mutex> lock(sumMutex);
+            change += localChange;
+        });
+        rank.swap(next);
+        if (change < config.tolerance) {
+            break;
+        }
+    }
+    return iteration;
+}
+
+// PageRank per vertex of a snapshot
+struct PageRankIndex {
+    std::shared_ptr<const GraphSnapshot> snapshot;
+    FloatArray rank;
+    float maxRank = 0.0f;
+    size_t iterations = 0;                  // iterations of the last computation
+
+    bool empty() const { return !snapshot; }
+
+    // PageRank of a user, or 0 if unknown to the snapshot
+    float rankOf(int userId) const {
+        int vertex = empty() ? -1 : snapshot->vertexOf(userId);
+        return vertex < 0 ? 0.0f : rank[vertex];
+    }
+};
+
+// Component per vertex of a snapshot, numbered densely
+struct ComponentIndex {
+    std::shared_ptr<const GraphSnapshot> snapshot;
+    CountedVector<int32_t, MemoryCategory::Indexes> component;
+    CountedVector<size_t, MemoryCategory::Indexes> componentSize;
+
+    bool empty() const { return !snapshot; }
+
+    // Component of a user, or -1 if unknown to the snapshot
+    int32_t componentOf(int userId) const {
+        int vertex = empty() ? -1 : snapshot->vertexOf(userId);
+        return vertex < 0 ? -1 : component[vertex];
+    }
+};
+
+// Core number per vertex of a snapshot
+struct CoreIndex {
+    std::shared_ptr<const GraphSnapshot> snapshot;
+    CountedVector<int32_t, MemoryCategory::Indexes> core;
+    int32_t maxCore = 0;
+
+    bool empty() const { return !snapshot; }
+
+    // Core number of a user, or -1 if unknown to the snapshot
+    int32_t coreOf(int userId) const {
+        int vertex = empty() ? -1 : snapshot->vertexOf(userId);
+        return vertex < 0 ? -1 : core[vertex];
+    }
+};
+
+// Space-Saving heavy-hitter summary in fixed memory. It keeps `capacity`
+// counters; an unmonitored key replaces the smallest counter and inherits its
+// count as error. Every reported count overestimates the true count by at
+// most its error, and any key with a true count above total / capacity is
+// guaranteed to be monitored.
+class SpaceSavingSketch {
+public:
+    explicit SpaceSavingSketch(size_t counterCapacity)
+        : capacity(std::max<size_t>(counterCapacity, 1)) {
+        keys.resize(capacity);
+        counts.resize(capacity);
+        errors.resize(capacity);
+        heap.resize(capacity);
+        heapPosition.resize(capacity);
+        size_t tableSize = 1;
+        while (tableSize < capacity * 2) {
+            tableSize <<= 1;
+        }
+        table.assign(tableSize, -1);
+    }
+
+    void add(int key, double weight) {
+        total += weight;
+        long long slot = find(key);
+        if (slot >= 0) {
+            counts[slot] += weight;
+            siftDown(heapPosition[slot]);
+            return;
+        }
+
+        size_t counter;
+        if (used < capacity) {
+            counter = used++;
+            counts[counter] = 0.0;
+            errors[counter] = 0.0;
+            heap[counter] = counter;
+            heapPosition[counter] = counter;
+            siftUp(counter);
+        } else {
+            // Evict the minimum; the newcomer may have been seen up to that many times
+            counter = heap[0];
+            erase(keys[counter]);
+            errors[counter] = counts[counter];
+        }
+        keys[counter] = key;
+        counts[counter] += weight;
+        insert(key, counter);
+        siftDown(heapPosition[counter]);
+    }
+
+    size_t size() const { return used; }
+    double streamWeight() const { return total; }
+
+    // Upper bound on the true count of any key that is not monitored
+    double minCount() const { return used < capacity ? 0.0 : counts[heap[0]]; }
+
+    int key(size_t counter) const { return keys[counter]; }
+    double count(size_t counter) const { return counts[counter]; }
+    double error(size_t counter) const { return errors[counter]; }
+
+private:
+    size_t capacity;
+    size_t used = 0;
+    double total = 0.0;
+    std::vector<int> keys;
+    std::vector<double> counts;
+    std::vector<double> errors;
+    std::vector<size_t> heap;               // min-heap of counters by count
+    std::vector<size_t> heapPosition;       // counter -> position in heap
+    std::vector<long long> table;           // open addressing: key -> counter, -1 when empty
+
+    size_t bucket(int key) const {
+        return static_cast<size_t>(mixBits(static_cast<uint64_t>(static_cast<uint32_t>(key)))) & (table.size() - 1);
+    }
+
+    long long find(int key) const {
+        for (size_t b = bucket(key);; b = (b + 1) & (table.size() - 1)) {
+            if (table[b] < 0) {
+                return -1;
+            }
+            if (keys[table[b]] == key) {
+                return table[b];
+            }
+        }
+    }
+
+    void insert(int key, size_t counter) {
+        size_t b = bucket(key);
+        while (table[b] >= 0) {
+            b = (b + 1) & (table.size() - 1);
+        }
+        table[b] = static_cast<long long>(counter);
+    }
+
+    // Linear-probing delete with backward shift, so no tombstones accumulate
+    void erase(int key) {
+        size_t mask = table.size() - 1;
+        size_t hole = bucket(key);
+        while (keys[table[hole]] != key) {
+            hole = (hole + 1) & mask;
+        }
+        size_t next = (hole + 1) & mask;
+        while (table[next] >= 0) {
+            size_t home = bucket(keys[table[next]]);
+            // Move the entry back if the hole lies between its home bucket and its slot
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                table[hole] = table[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        table[hole] = -1;
+    }
+
+    void swapHeap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        heapPosition[heap[a]] = a;
+        heapPosition[heap[b]] = b;
+    }
+
+    void siftUp(size_t position) {
+        while (position > 0) {
+            size_t parent = (position - 1) / 2;
+            if (counts[heap[parent]] <= counts[heap[position]]) {
+                break;
+            }
+            swapHeap(parent, position);
+            position = parent;
+        }
+    }
+
+    void siftDown(size_t position) {
+        while (true) {
+            size_t smallest = position;
+            size_t left = position * 2 + 1;
+            size_t right = left + 1;
+            if (left < used && counts[heap[left]] < counts[heap[smallest]]) {
+                smallest = left;
+            }
+            if (right < used && counts[heap[right]] < counts[heap[smallest]]) {
+                smallest = right;
+            }
+            if (smallest == position) {
+                break;
+            }
+            swapHeap(position, smallest);
+            position = smallest;
+        }
+    }
+};
+
+// One result of the similarity join, written to disk as-is (12 bytes)
+struct SimilarPair {
+    int32_t userId1;
+    int32_t userId2;
+    float similarity;
+};
+
+// Streaming binary writer for similarity join results. The stream starts
+// with the magic "SMPJ" and a uint32 format version, followed by packed
+// SimilarPair records. Worker threads fill private buffers and hand them
+// over in blocks, so the lock is taken once per block rather than per pair.
+class SimilarPairWriter {
+public:
+    static constexpr uint32_t formatVersion = 1;
+    static constexpr size_t blockPairs = 4096;
+
+    explicit SimilarPairWriter(std::ostream& stream) : out(stream) {
+        out.write("SMPJ", 4);
+        out.write(reinterpret_cast<const char*>(&formatVersion), sizeof(formatVersion));
+    }
+
+    // Append a worker's buffer and clear it
+    void flush(std::vector<SimilarPair>& buffer) {
+        if (buffer.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        out.write(reinterpret_cast<const char*>(buffer.data()),
+                  static_cast<std::streamsize>(buffer.size() * sizeof(SimilarPair)));
+        written += buffer.size();
+        buffer.clear();
+    }
+
+    size_t pairsWritten() const { return written; }
+
+private:
+    std::ostream& out;
+    std::mutex mutex;
+    size_t written = 0;
+};
+
+// All pairs of vertices whose neighbour sets have Jaccard similarity of at
+// least threshold, in the style of PPJoin. Neighbours are renamed to their
+// rank in ascending global frequency (degree) order so rare tokens come
+// first; records are processed shortest first and each one probes only its
+// prefix against an inverted index of shorter records, pruning by length
+// and by position before verifying survivors with a full intersection.
+// Records are claimed in blocks by the worker threads.
+inline size_t similarityJoin(const GraphSnapshot& graph, double threshold, SimilarPairWriter& writer,
+                             bool includeConnected = true) {
+    size_t n = graph.vertexCount();
+    if (n == 0 || threshold <= 0.0 || threshold > 1.0) {
+        return 0;
+    }
+
+    std::vector<int> byFrequency(n);
+    for (size_t v = 0; v < n; v++) {
+        byFrequency[v] = static_cast<int>(v);
+    }
+    std::sort(byFrequency.begin(), byFrequency.end(), [&graph](int a, int b) {
+        size_t da = graph.degree(a);
+        size_t db = graph.degree(b);
+        return da < db || (da == db && a < b);
+    });
+    std::vector<int> tokenRank(n);
+    for (size_t r = 0; r < n; r++) {
+        tokenRank[byFrequency[r]] = static_cast<int>(r);
+    }
+
+    // Records in processing order (ascending length); order is byFrequency too
+    const std::vector<int>& order = byFrequency;
+    std::vector<size_t> recordOffsets(n + 1, 0);
+    for (size_t p = 0; p < n; p++) {
+        recordOffsets[p + 1] = recordOffsets[p] + graph.degree(order[p]);
+    }
+    std::vector<int> tokens(recordOffsets[n]);
+    parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            int* row = tokens.data() + recordOffsets[p];
+            size_t count = 0;
+            for (const int* it = graph.begin(order[p]); it != graph.end(order[p]); ++it) {
+                row[count++] = tokenRank[*it];
+            }
+            std::sort(row, row + count);
+        }
+    });
+    auto length = [&recordOffsets](size_t p) { return recordOffsets[p + 1] - recordOffsets[p]; };
+
+    // Inverted index over the indexing prefix |y| - ceil(2t/(1+t) |y|) + 1,
+    // which is enough when every probe comes from a record at least as long
+    double indexFactor = 2.0 * threshold / (1.0 + threshold);
+    std::vector<size_t> postingOffsets(n + 1, 0);
+    auto indexPrefix = [&](size_t p) {
+        size_t len = length(p);
+        return len == 0 ? 0 : len - static_cast<size_t>(std::ceil(indexFactor * len - 1e-9)) + 1;
+    };
+    for (size_t p = 0; p < n; p++) {
+        for (size_t i = 0; i < indexPrefix(p); i++) {
+            postingOffsets[tokens[recordOffsets[p] + i] + 1]++;
+        }
+    }
+    for (size_t t = 0; t < n; t++) {
+        postingOffsets[t + 1] += postingOffsets[t];
+    }
+    // Postings hold (record position, token position) and stay sorted by record
+    std::vector<std::pair<uint32_t, uint32_t>> postings(postingOffsets[n]);
+    {
+        std::vector<size_t> fill(postingOffsets.begin(), postingOffsets.end() - 1);
+        for (size_t p = 0; p < n; p++) {
+            for (size_t i = 0; i < indexPrefix(p); i++) {
+                int token = tokens[recordOffsets[p] + i];
+                postings[fill[token]++] = {static_cast<uint32_t>(p), static_cast<uint32_t>(i)};
+            }
+        }
+    }
+
+    std::atomic<size_t> nextBlock(0);
+    const size_t blockSize = 64;
+    parallelFor(0, hardwareThreads(), [&](size_t, size_t) {
+        std::vector<int> overlap(n, 0);
+        std::vector<uint32_t> touched;
+        std::vector<SimilarPair> buffer;
+        buffer.reserve(SimilarPairWriter::blockPairs);
+
+        for (size_t block = nextBlock++; block * blockSize < n; block = nextBlock++) {
+            size_t blockEnd = std::min(n, (block + 1) * blockSize);
+            for (size_t x = block * blockSize; x < blockEnd; x++) {
+                size_t lenX = length(x);
+                if (lenX == 0) {
+                    continue;
+                }
+                const int* recordX = tokens.data() + recordOffsets[x];
+                size_t probePrefix = lenX - static_cast<size_t>(std::ceil(threshold * lenX - 1e-9)) + 1;
+                size_t minLength = static_cast<size_t>(std::ceil(threshold * lenX - 1e-9));
+
+                for (size_t i = 0; i < probePrefix; i++) {
+                    int token = recordX[i];
+                    for (size_t e = postingOffsets[token]; e < postingOffsets[token + 1]; e++) {
+                        uint32_t y = postings[e].first;
+                        if (y >= x) {
+                            break;
+                        }
+                        size_t lenY = length(y);
+                        if (lenY < minLength || overlap[y] < 0) {
+                            continue;
+                        }
+                        size_t j = postings[e].second;
+                        int required = static_cast<int>(std::ceil(threshold / (1.0 + threshold) * (lenX + lenY) - 1e-9));
+                        int bound = overlap[y] + 1 + static_cast<int>(std::min(lenX - i - 1, lenY - j - 1));
+                        if (overlap[y] == 0) {
+                            touched.push_back(y);
+                        }
+                        // Positional filter: even matching everything that is left falls short
+                        overlap[y] = bound < required ? -1 : overlap[y] + 1;
+                    }
+                }
+
+                for (uint32_t y : touched) {
+                    if (overlap[y] > 0) {
+                        size_t lenY = length(y);
+                        size_t shared = 0;
+                        intersectSorted(recordX, lenX, tokens.data() + recordOffsets[y], lenY,
+                                        [&shared](size_t, size_t) { shared++; });
+                        double similarity = static_cast<double>(shared) / static_cast<double>(lenX + lenY - shared);
+                        int vx = order[x];
+                        int vy = order[y];
+                        if (similarity >= threshold &&
+                            (includeConnected || !std::binary_search(graph.begin(vx), graph.end(vx), vy))) {
+                            buffer.push_back({graph.ids[vy], graph.ids[vx], static_cast<float>(similarity)});
+                            if (buffer.size() >= SimilarPairWriter::blockPairs) {
+                                writer.flush(buffer);
+                            }
+                        }
+                    }
+                    overlap[y] = 0;
+                }
+                touched.clear();
+            }
+        }
+        writer.flush(buffer);
+    });
+    return writer.pairsWritten();
+}
+
+// What the common-friend recommender does with an intermediate friend whose
+// degree is above QueryOptions::supernodeDegree
+enum class SupernodePolicy {
+    Sample,     // visit a uniform sample and re-weight each hit by degree / sample size
+    Skip        // do not expand the intermediate at all
+};
+
+// Fixed-size bitmap over dense row numbers
+struct Bitmap {
+    std::vector<uint64_t> words;
+
+    void resize(size_t bits) { words.resize((bits + 63) / 64, 0); }
+    size_t capacity() const { return words.size() * 64; }
+
+    void set(size_t bit) { words[bit / 64] |= uint64_t(1) << (bit % 64); }
+    void reset(size_t bit) { words[bit / 64] &= ~(uint64_t(1) << (bit % 64)); }
+    bool test(size_t bit) const {
+        return bit / 64 < words.size() && (words[bit / 64] >> (bit % 64)) & 1;
+    }
+
+    void orWith(const Bitmap& other) {
+        if (words.size() < other.words.size()) {
+            words.resize(other.words.size(), 0);
+        }
+        for (size_t i = 0; i < other.words.size(); i++) {
+            words[i] |= other.words[i];
+        }
+    }
+
+    void andWith(const Bitmap& other) {
+        for (size_t i = 0; i < words.size(); i++) {
+            words[i] &= i < other.words.size() ? other.words[i] : 0;
+        }
+    }
+};
+
+// "attribute is one of values"
+struct AttributePredicate {
+    std::string attribute;
+    std::vector<std::string> values;
+};
+
+// Columnar store of per-user string attributes (country, age band, school...).
+// Users get a dense row on first use; each column keeps a dictionary-encoded
+// code per row plus one bitmap of rows per distinct value, so a conjunction
+// of predicates compiles to a few word-wide ORs and ANDs.
+class AttributeStore {
+public:
+    void set(int userId, const std::string& attribute, const std::string& value) {
+        size_t row = rowFor(userId);
+        Column& column = columns[attribute];
+        if (column.values.empty()) {
+            column.values.push_back("");    // code 0 means "no value"
+            column.bitmaps.emplace_back();
+        }
+        if (column.cells.size() < users.size()) {
+            column.cells.resize(users.size(), 0);
+        }
+
+        uint32_t code = 0;
+        if (!value.empty()) {
+            auto inserted = column.codes.insert({value, static_cast<uint32_t>(column.values.size())});
+            if (inserted.second) {
+                column.values.push_back(value);
+                column.bitmaps.emplace_back();
+            }
+            code = inserted.first->second;
+        }
+
+        uint32_t previous = column.cells[row];
+        if (previous != 0) {
+            column.bitmaps[previous].reset(row);
+        }
+        column.cells[row] = code;
+        if (code != 0) {
+            Bitmap& bitmap = column.bitmaps[code];
+            if (bitmap.capacity() <= row) {
+                bitmap.resize(std::max(row + 1, bitmap.capacity() * 2));
+            }
+            bitmap.set(row);
+        }
+    }
+
+    // Value of an attribute, or an empty string if it is not set
+    const std::string& get(int userId, const std::string& attribute) const {
+        static const std::string none;
+        long long row = rowOf(userId);
+        auto column = columns.find(attribute);
+        if (row < 0 || column == columns.end() || static_cast<size_t>(row) >= column->second.cells.size()) {
+            return none;
+        }
+        return column->second.values[column->second.cells[row]];
+    }
+
+    // Dense row of a user, or -1 if the user has no attributes
+    long long rowOf(int userId) const {
+        auto it = rows.find(userId);
+        return it == rows.end() ? -1 : static_cast<long long>(it->second);
+    }
+
+    // Rows satisfying every predicate
+    Bitmap evaluate(const std::vector<AttributePredicate>& predicates) const {
+        Bitmap result;
+        result.resize(users.size());
+        std::fill(result.words.begin(), result.words.end(), ~uint64_t(0));
+        for (const auto& predicate : predicates) {
+            Bitmap matches;
+            matches.resize(users.size());
+            auto column = columns.find(predicate.attribute);
+            if (column != columns.end()) {
+                for (const auto& value : predicate.values) {
+                    auto code = column->second.codes.find(value);
+                    if (code != column->second.codes.end()) {
+                        matches.orWith(column->second.bitmaps[code->second]);
+                    }
+                }
+            }
+            result.andWith(matches);
+        }
+        return result;
+    }
+
+    size_t rowCount() const { return users.size(); }
+
+private:
+    struct Column {
+        std::unordered_map<std::string, uint32_t> codes;  // value -> code
+        std::vector<std::string> values;                  // code -> value
+        std::vector<uint32_t> cells;                      // row -> code
+        std::vector<Bitmap> bitmaps;                      // code -> rows holding the value
+    };
+
+    std::unordered_map<int, uint32_t> rows;
+    std::vector<int> users;                               // row -> user id
+    std::unordered_map<std::string, Column> columns;
+
+    size_t rowFor(int userId) {
+        auto inserted = rows.insert({userId, static_cast<uint32_t>(users.size())});
+        if (inserted.second) {
+            users.push_back(userId);
+        }
+        return inserted.first->second;
+    }
+};
+
+// Users one user must never be recommended again (blocked or dismissed).
+// A Bloom filter answers most lookups, which are misses, from a few bits;
+// a hit is confirmed against the exact sorted list.
+class ExclusionList {
+public:
+    void add(int userId) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), userId);
+        if (it != sorted.end() && *it == userId) {
+            return;
+        }
+        sorted.insert(it, userId);
+        if (sorted.size() > bloomCapacity) {
+            rebuildBloom();
+        } else {
+            addToBloom(userId);
+        }
+    }
+
+    void remove(int userId) {
+        auto it = std::lower_bound(sorted.begin(), sorted.end(), userId);
+        if (it != sorted.end() && *it == userId) {
+            sorted.erase(it);
+            rebuildBloom();
+        }
+    }
+
+    bool contains(int userId) const {
+        if (sorted.empty() || !bloomMayContain(userId)) {
+            return false;
+        }
+        return std::binary_search(sorted.begin(), sorted.end(), userId);
+    }
+
+    const CountedVector<int, MemoryCategory::Indexes>& users() const { return sorted; }
+
+    // Replace the whole list, e.g. when loading a snapshot
+    void assign(std::vector<int> userIds) {
+        std::sort(userIds.begin(), userIds.end());
+        userIds.erase(std::unique(userIds.begin(), userIds.end()), userIds.end());
+        sorted.assign(userIds.begin(), userIds.end());
+        rebuildBloom();
+    }
+
+private:
+    static constexpr size_t bitsPerUser = 10;
+    static constexpr int hashCount = 4;
+
+    CountedVector<int, MemoryCategory::Indexes> sorted;
+    CountedVector<uint64_t, MemoryCategory::Indexes> bloom;
+    size_t bloomCapacity = 0;
+
+    // Double hashing: probe i is h1 + i * h2
+    template <typename Fn>
+    void forEachProbe(int userId, Fn fn) const {
+        uint64_t hash = mixBits(static_cast<uint64_t>(static_cast<uint32_t>(userId)));
+        uint64_t h1 = hash & 0xffffffffULL;
+        uint64_t h2 = (hash >> 32) | 1;
+        size_t bits = bloom.size() * 64;
+        for (int i = 0; i < hashCount; i++) {
+            fn(static_cast<size_t>((h1 + i * h2) % bits));
+        }
+    }
+
+    void addToBloom(int userId) {
+        forEachProbe(userId, [this](size_t bit) { bloom[bit / 64] |= uint64_t(1) << (bit % 64); });
+    }
+
+    bool bloomMayContain(int userId) const {
+        bool present = true;
+        forEachProbe(userId, [this, &present](size_t bit) {
+            present = present && ((bloom[bit / 64] >> (bit % 64)) & 1);
+        });
+        return present;
+    }
+
+    void rebuildBloom() {
+        bloomCapacity = std::max<size_t>(8, sorted.size() * 2);
+        bloom.assign((bloomCapacity * bitsPerUser + 63) / 64, 0);
+        for (int userId : sorted) {
+            addToBloom(userId);
+        }
+    }
+};
+
+// Raw binary helpers for the snapshot format
+template <typename T>
+inline void writeBinary(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+inline T readBinary(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(T))) {
+        throw std::runtime_error("Truncated graph snapshot");
+    }
+    return value;
+}
+
+// Order in which recommendTopKByCommonFriends expands the user's friends
+enum class ExpansionOrder {
+    AscendingDegree,    // cheap friends first, so expensive hubs are the ones pruned
+    DescendingDegree    // most productive friends first, scores settle sooner
+};
+
+// Options shared by the recommendation methods. They change which candidates
+// are considered and how they are ranked; the value reported next to every
+// candidate keeps the meaning of the plain method (count, distance, score).
+struct QueryOptions {
+    // Community-aware scoring, effective once detectCommunities() has run
+    bool sameCommunityOnly = false;         // drop candidates from other communities
+    double sameCommunityBoost = 0.0;        // relative ranking boost for same-community candidates
+
+    // Tie strength, effective once computeTieStrength() has run. Each common
+    // friend f counts 1 + tieStrengthWeight * overlap(user, f) when ranking.
+    double tieStrengthWeight = 0.0;
+
+    // Core-number pruning, effective once computeCoreNumbers() has run.
+    // Users unknown to the last decomposition are never pruned.
+    int minCandidateCore = 0;               // skip candidates below this core number
+    int maxIntermediateCore = 0;            // do not expand through users above this core (0 = no limit)
+
+    // Supernode handling: friends with more than supernodeDegree friends are
+    // sampled or skipped, which bounds the work per intermediate (0 = off).
+    // Sampling reads a CSR row and so needs a current snapshot (loaded, or
+    // refreshed with currentSnapshot()); without one, e.g. after any
+    // mutation, supernodes are skipped instead, so the bound holds either way.
+    size_t supernodeDegree = 0;
+    SupernodePolicy supernodePolicy = SupernodePolicy::Sample;
+    size_t supernodeSampleSize = 1024;
+    uint64_t samplingSeed = 1;
+
+    // Approximate counting: when non-zero, recommendByCommonFriends counts
+    // friends-of-friends in a Space-Saving sketch with this many counters
+    // instead of an exact map. Tie-strength weighting is not applied then.
+    size_t approximateCounters = 0;
+
+    // Popularity prior, effective once computePageRank() has run. Candidates
+    // get a ranking boost of pageRankWeight * rank / highest rank.
+    double pageRankWeight = 0.0;
+
+    // Friend order used by recommendTopKByCommonFriends
+    ExpansionOrder expansionOrder = ExpansionOrder::AscendingDegree;
+
+    // Attribute predicates, all of which a candidate must satisfy. They are
+    // compiled to a row bitmap once per query and checked before counting.
+    std::vector<AttributePredicate> attributeFilters;
+};
+
+// Work counters filled in by the recommenders when a stats pointer is passed
+struct QueryStats {
+    size_t intermediatesExpanded = 0;       // friends whose neighbours were visited
+    size_t edgesScanned = 0;                // neighbour entries read
+    size_t counterUpdates = 0;              // increments of per-candidate counters
+    size_t supernodesSampled = 0;
+    size_t supernodesSkipped = 0;
+    size_t edgesSkipped = 0;                // neighbour entries not counted due to the supernode policy
+
+    // Approximate counting only: the true count of result i lies in
+    // [count - countErrors[i], count], and any candidate left out of the
+    // result has a true count of at most maxCountError
+    std::vector<int> countErrors;
+    int maxCountError = 0;
+
+    // Top-K search only: friends never expanded because the top K was settled
+    size_t friendsPruned = 0;
+};
+
+// Friend-of-friend counting over any graph view that offers
+// hasUser(userId) and forEachFriend(userId, fn); same results as
+// SocialNetwork::recommendByCommonFriends
+template <typename Graph>
+std::vector<std::pair<int, int>> commonFriendCounts(const Graph& graph, int userId) {
+    std::unordered_set<int> userFriends;
+    graph.forEachFriend(userId, [&userFriends](int friendId) { userFriends.insert(friendId); });
+
+    std::unordered_map<int, int> potentialFriends;
+    for (int currentFriend : userFriends) {
+        graph.forEachFriend(currentFriend, [&](int friendOfFriend) {
+            if (friendOfFriend != userId && !userFriends.count(friendOfFriend)) {
+                potentialFriends[friendOfFriend]++;
+            }
+        });
+    }
+
+    std::vector<std::pair<int, int>> recommendations(potentialFriends.begin(), potentialFriends.end());
+    std::sort(recommendations.begin(), recommendations.end(),
+        [](const auto& a, const auto& b) {
+            return a.second > b.second;
+        });
+    return recommendations;
+}
+
+// Breadth-first distances over a graph view; same results as
+// SocialNetwork::recommendByNetworkDistance
+template <typename Graph>
+std::vector<std::pair<int, int>> networkDistances(const Graph& graph, int userId, int maxDistance) {
+    std::vector<std::pair<int, int>> recommendations;
+    if (!graph.hasUser(userId)) {
+        return recommendations;
+    }
+    std::unordered_set<int> userFriends;
+    graph.forEachFriend(userId, [&userFriends](int friendId) { userFriends.insert(friendId); });
+
+    std::unordered_set<int> visited = {userId};
+    std::vector<int> frontier = {userId};
+    for (int distance = 0; distance <= maxDistance && !frontier.empty(); distance++) {
+        std::vector<int> next;
+        for (int currentUser : frontier) {
+            graph.forEachFriend(currentUser, [&](int neighbor) {
+                if (visited.insert(neighbor).second) {
+                    next.push_back(neighbor);
+                    if (!userFriends.count(neighbor)) {
+                        recommendations.push_back({neighbor, distance + 1});
+                    }
+                }
+            });
+        }
+        frontier.swap(next);
+    }
+    return recommendations;
+}
+
+// Mutable graph with CSR-speed reads, organised like a log-structured merge
+// tree: an immutable CSR base plus small sorted per-user insert/delete
+// buffers that readers merge on the fly. Once the buffers hold
+// compactionThreshold edits they are frozen and folded into a new base on a
+// background thread; readers keep using base + frozen + fresh buffers until
+// the new base is swapped in under a short exclusive lock.
+class DeltaGraph {
+public:
+    struct Metrics {
+        size_t baseEdges = 0;               // directed entries in the CSR base
+        size_t pendingInserts = 0;          // directed entries in delta buffers
+        size_t pendingDeletes = 0;
+        size_t compactions = 0;
+        double lastCompactionMillis = 0.0;
+        size_t compactionThreshold = 0;
+        bool compacting = false;
+    };
+
+    explicit DeltaGraph(size_t threshold = 1 << 16)
+        : base(emptySnapshot()), compactionThreshold(threshold) {}
+
+    DeltaGraph(std::shared_ptr<const GraphSnapshot> initial, size_t threshold = 1 << 16)
+        : base(std::move(initial)), compactionThreshold(threshold) {}
+
+    DeltaGraph(const DeltaGraph&) = delete;
+    DeltaGraph& operator=(const DeltaGraph&) = delete;
+
+    ~DeltaGraph() {
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+    }
+
+    void addUser(int userId) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (!hasUserLocked(userId)) {
+            active[userId];
+        }
+    }
+
+    void addConnection(int userId1, int userId2) {
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            setEdge(userId1, userId2, true);
+            if (userId1 != userId2) {
+                setEdge(userId2, userId1, true);
+            }
+        }
+        maybeCompact();
+    }
+
+    void removeConnection(int userId1, int userId2) {
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (!hasUserLocked(userId1) || !hasUserLocked(userId2)) {
+                return;
+            }
+            setEdge(userId1, userId2, false);
+            if (userId1 != userId2) {
+                setEdge(userId2, userId1, false);
+            }
+        }
+        maybeCompact();
+    }
+
+    bool hasUser(int userId) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return hasUserLocked(userId);
+    }
+
+    // Call fn(friendId) for every current friend: base row minus deletes plus inserts
+    template <typename Fn>
+    void forEachFriend(int userId, Fn fn) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const VertexDelta* frozenDelta = find(frozen.get(), userId);
+        const VertexDelta* activeDelta = find(&active, userId);
+        int vertex = base->vertexOf(userId);
+        if (vertex >= 0) {
+            for (const int* it = base->begin(vertex); it != base->end(vertex); ++it) {
+                int friendId = base->ids[*it];
+                if (!contains(frozenDelta, &VertexDelta::deletes, friendId) &&
+                    !contains(activeDelta, &VertexDelta::deletes, friendId)) {
+                    fn(friendId);
+                }
+            }
+        }
+        if (frozenDelta) {
+            for (int friendId : frozenDelta->inserts) {
+                if (!contains(activeDelta, &VertexDelta::deletes, friendId)) {
+                    fn(friendId);
+                }
+            }
+        }
+        if (activeDelta) {
+            for (int friendId : activeDelta->inserts) {
+                fn(friendId);
+            }
+        }
+    }
+
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) const {
+        return commonFriendCounts(*this, userId);
+    }
+
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(int userId, int maxDistance) const {
+        return networkDistances(*this, userId, maxDistance);
+    }
+
+    // Fold all pending deltas into a new base and wait for it. Holding
+    // compactorMutex throughout keeps maybeCompact from starting a
+    // background compaction between the join and the synchronous one.
+    void compact() {
+        std::lock_guard<std::mutex> lock(compactorMutex);
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+        runCompaction();
+    }
+
+    void waitForCompaction() {
+        std::lock_guard<std::mutex> lock(compactorMutex);
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+    }
+
+    void setCompactionThreshold(size_t threshold) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        compactionThreshold = threshold;
+    }
+
+    Metrics metrics() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        Metrics result;
+        result.baseEdges = base->edgeCount();
+        for (const DeltaMap* layer : {frozen.get(), &active}) {
+            if (!layer) {
+                continue;
+            }
+            for (const auto& entry : *layer) {
+                result.pendingInserts += entry.second.inserts.size();
+                result.pendingDeletes += entry.second.deletes.size();
+            }
+        }
+        result.compactions = compactions;
+        result.lastCompactionMillis = lastCompactionMillis;
+        result.compactionThreshold = compactionThreshold;
+        result.compacting = frozen != nullptr;
+        return result;
+    }
+
+private:
+    // Sorted friend ids added or removed relative to the layers below
+    struct VertexDelta {
+        std::vector<int> inserts;
+        std::vector<int> deletes;
+    };
+    using DeltaMap = std::unordered_map<int, VertexDelta>;
+
+    mutable std::shared_mutex mutex;
+    std::shared_ptr<const GraphSnapshot> base;
+    std::shared_ptr<const DeltaMap> frozen;     // being folded into the next base
+    DeltaMap active;
+    size_t activeEdits = 0;
+    size_t compactionThreshold;
+    size_t compactions = 0;
+    double lastCompactionMillis = 0.0;
+
+    std::mutex compactorMutex;
+    std::thread compactor;
+
+    static std::shared_ptr<const GraphSnapshot> emptySnapshot() {
+        auto empty = std::make_shared<GraphSnapshot>();
+        empty->offsets.assign(1, 0);
+        return empty;
+    }
+
+    static const VertexDelta* find(const DeltaMap* layer, int userId) {
+        if (!layer) {
+            return nullptr;
+        }
+        auto it = layer->find(userId);
+        return it == layer->end() ? nullptr : &it->second;
+    }
+
+    static bool contains(const VertexDelta* delta, std::vector<int> VertexDelta::*list, int userId) {
+        return delta && std::binary_search((delta->*list).begin(), (delta->*list).end(), userId);
+    }
+
+    static bool insertSorted(std::vector<int>& list, int userId) {
+        auto it = std::lower_bound(list.begin(), list.end(), userId);
+        if (it != list.end() && *it == userId) {
+            return false;
+        }
+        list.insert(it, userId);
+        return true;
+    }
+
+    static bool eraseSorted(std::vector<int>& list, int userId) {
+        auto it = std::lower_bound(list.begin(), list.end(), userId);
+        if (it == list.end() || *it != userId) {
+            return false;
+        }
+        list.erase(it);
+        return true;
+    }
+
+    bool hasUserLocked(int userId) const {
+        return base->vertexOf(userId) >= 0 || find(frozen.get(), userId) || find(&active, userId);
+    }
+
+    // Whether an edge exists in base + frozen, ignoring the active buffers
+    bool presentBelowActive(int source, int target) const {
+        const VertexDelta* frozenDelta = find(frozen.get(), source);
+        if (contains(frozenDelta, &VertexDelta::inserts, target)) {
+            return true;
+        }
+        if (contains(frozenDelta, &VertexDelta::deletes, target)) {
+            return false;
+        }
+        int u = base->vertexOf(source);
+        int v = base->vertexOf(target);
+        return u >= 0 && v >= 0 && std::binary_search(base->begin(u), base->end(u), v);
+    }
+
+    // Record one directed edit; an insert only lists edges missing below and a
+    // delete only lists edges present below, so merged reads never repeat
+    void setEdge(int source, int target, bool present) {
+        VertexDelta& delta = active[source];
+        bool below = presentBelowActive(source, target);
+        if (present) {
+            if (below) {
+                activeEdits += eraseSorted(delta.deletes, target);
+            } else {
+                activeEdits += insertSorted(delta.inserts, target);
+            }
+        } else {
+            if (below) {
+                activeEdits += insertSorted(delta.deletes, target);
+            } else {
+                activeEdits += eraseSorted(delta.inserts, target);
+            }
+        }
+    }
+
+    void maybeCompact() {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            if (activeEdits < compactionThreshold || frozen) {
+                return;
+            }
+        }
+        std::unique_lock<std::mutex> lock(compactorMutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+        compactor = std::thread([this]() { runCompaction(); });
+    }
+
+    void runCompaction() {
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<const GraphSnapshot> oldBase;
+        std::shared_ptr<const DeltaMap> pending;
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (frozen || active.empty()) {
+                return;
+            }
+            frozen = std::make_shared<const DeltaMap>(std::move(active));
+            active = DeltaMap();
+            activeEdits = 0;
+            oldBase = base;
+            pending = frozen;
+        }
+
+        // Built without holding the lock: both inputs are immutable
+        std::shared_ptr<const GraphSnapshot> merged = mergeDeltas(*oldBase, *pending);
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        base = std::move(merged);
+        frozen.reset();
+        compactions++;
+        lastCompactionMillis = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    static std::shared_ptr<const GraphSnapshot> mergeDeltas(const GraphSnapshot& oldBase, const DeltaMap& deltas) {
+        auto result = std::make_shared<GraphSnapshot>();
+        result->ids = oldBase.ids;
+        for (const auto& entry : deltas) {
+            if (oldBase.vertexOf(entry.first) < 0) {
+                result->ids.push_back(entry.first);
+            }
+        }
+        std::sort(result->ids.begin(), result->ids.end());
+        size_t n = result->ids.size();
+        result->index.reserve(n);
+        for (size_t v = 0; v < n; v++) {
+            result->index[result->ids[v]] = static_cast<int>(v);
+        }
+
+        // Merged rows as user ids, then converted to sorted vertex indices
+        std::vector<std::vector<int>> rows(n);
+        parallelFor(0, n, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                int userId = result->ids[v];
+                const VertexDelta* delta = find(&deltas, userId);
+                int old = oldBase.vertexOf(userId);
+                std::vector<int>& row = rows[v];
+                if (old >= 0) {
+                    for (const int* it = oldBase.begin(old); it != oldBase.end(old); ++it) {
+                        int friendId = oldBase.ids[*it];
+                        if (!contains(delta, &VertexDelta::deletes, friendId)) {
+                            row.push_back(result->index.at(friendId));
+                        }
+                    }
+                }
+                if (delta) {
+                    for (int friendId : delta->inserts) {
+                        row.push_back(result->index.at(friendId));
+                    }
+                }
+                std::sort(row.begin(), row.end());
+            }
+        });
+
+        result->offsets.assign(n + 1, 0);
+        for (size_t v = 0; v < n; v++) {
+            result->offsets[v + 1] = result->offsets[v] + rows[v].size();
+        }
+        result->neighbors.resize(result->offsets[n]);
+        parallelFor(0, n, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                std::copy(rows[v].begin(), rows[v].end(), result->neighbors.begin() + result->offsets[v]);
+            }
+        });
+        return result;
+    }
+};
+
+// Persistent (copy-on-write) adjacency. Friend lists live in the leaves of a
+// 32-way radix trie keyed by user id; a mutation copies only the trie path
+// and the friend list it changes, and every other node stays shared with
+// older versions. Taking a version copies one pointer. Nodes that no
+// version shares are updated in place, so a writer without retained
+// versions pays no copying at all. Single writer; versions may be read
+// from any thread.
+class PersistentGraph {
+private:
+    static constexpr int bitsPerLevel = 5;
+    static constexpr size_t fanout = size_t(1) << bitsPerLevel;
+    static constexpr int levels = (32 + bitsPerLevel - 1) / bitsPerLevel;
+
+    using Row = std::vector<int>;           // sorted friend ids
+
+    // Slots point to child Nodes on inner levels and to Rows on the last level
+    struct Node {
+        std::array<std::shared_ptr<void>, fanout> slots;
+    };
+
+    static size_t slotAt(int userId, int level) {
+        uint32_t key = static_cast<uint32_t>(userId);
+        int shift = (levels - 1 - level) * bitsPerLevel;
+        return (key >> shift) & (fanout - 1);
+    }
+
+public:
+    // Immutable view of the graph at one point in time; cheap to copy
+    class Version {
+    public:
+        Version() = default;
+
+        bool hasUser(int userId) const { return find(userId) != nullptr; }
+        size_t userCount() const { return users; }
+
+        template <typename Fn>
+        void forEachFriend(int userId, Fn fn) const {
+            const Row* row = find(userId);
+            if (row) {
+                for (int friendId : *row) {
+                    fn(friendId);
+                }
+            }
+        }
+
+        std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) const {
+            return commonFriendCounts(*this, userId);
+        }
+
+        std::vector<std::pair<int, int>> recommendByNetworkDistance(int userId, int maxDistance) const {
+            return networkDistances(*this, userId, maxDistance);
+        }
+
+    private:
+        friend class PersistentGraph;
+        std::shared_ptr<Node> root;
+        size_t users = 0;
+
+        const Row* find(int userId) const {
+            const Node* node = root.get();
+            for (int level = 0; node && level < levels - 1; level++) {
+                node = static_cast<const Node*>(node->slots[slotAt(userId, level)].get());
+            }
+            return node ? static_cast<const Row*>(node->slots[slotAt(userId, levels - 1)].get()) : nullptr;
+        }
+    };
+
+    // Copy counters, i.e. how much memory the retained versions cost
+    struct Metrics {
+        size_t nodesCopied = 0;
+        size_t rowsCopied = 0;
+        size_t entriesCopied = 0;
+    };
+
+    PersistentGraph() { head.root = std::make_shared<Node>(); }
+
+    // Trie nodes (root included) and node size needed to hold the given
+    // ascending user ids; used for capacity planning
+    template <typename Ids>
+    static size_t trieNodeCount(const Ids& sortedIds) {
+        size_t nodes = 1;
+        for (int level = 0; level < levels - 1; level++) {
+            int shift = (levels - 1 - level) * bitsPerLevel;
+            for (size_t i = 0; i < sortedIds.size(); i++) {
+                uint32_t prefix = static_cast<uint32_t>(sortedIds[i]) >> shift;
+                if (i == 0 || prefix != static_cast<uint32_t>(sortedIds[i - 1]) >> shift) {
+                    nodes++;
+                }
+            }
+        }
+        return nodes;
+    }
+
+    static constexpr size_t nodeBytes() { return sizeof(Node); }
+
+    // O(1): the returned version shares everything with the head
+    Version snapshot() const { return head; }
+
+    void addUser(int userId) {
+        if (!head.hasUser(userId)) {
+            mutableRow(userId);
+        }
+    }
+
+    void addConnection(int userId1, int userId2) {
+        insertSorted(mutableRow(userId1), userId2);
+        insertSorted(mutableRow(userId2), userId1);
+    }
+
+    void removeConnection(int userId1, int userId2) {
+        if (!head.hasUser(userId1) || !head.hasUser(userId2)) {
+            return;
+        }
+        eraseSorted(mutableRow(userId1), userId2);
+        eraseSorted(mutableRow(userId2), userId1);
+    }
+
+    const Metrics& metrics() const { return stats; }
+
+private:
+    Version head;
+    Metrics stats;
+
+    // Node that the head may modify: reused when nothing else references it
+    std::shared_ptr<Node> own(const std::shared_ptr<Node>& node) {
+        if (node.use_count() == 1) {
+            return node;
+        }
+        stats.nodesCopied++;
+        return std::make_shared<Node>(*node);
+    }
+
+    std::shared_ptr<Node> own(const std::shared_ptr<void>& slot) {
+        if (!slot) {
+            return std::make_shared<Node>();
+        }
+        if (slot.use_count() == 1) {
+            return std::static_pointer_cast<Node>(slot);
+        }
+        stats.nodesCopied++;
+        return std::make_shared<Node>(*static_cast<const Node*>(slot.get()));
+    }
+
+    // Walk to a user's friend list, copying shared nodes on the way down
+    Row& mutableRow(int userId) {
+        head.root = own(head.root);
+        Node* node = head.root.get();
+        for (int level = 0; level < levels - 1; level++) {
+            std::shared_ptr<void>& child = node->slots[slotAt(userId, level)];
+            std::shared_ptr<Node> owned = own(child);
+            child = owned;
+            node = owned.get();
+        }
+
+        std::shared_ptr<void>& row = node->slots[slotAt(userId, levels - 1)];
+        if (!row) {
+            row = std::make_shared<Row>();
+            head.users++;
+        } else if (row.use_count() > 1) {
+            stats.rowsCopied++;
+            stats.entriesCopied += static_cast<Row*>(row.get())->size();
+            row = std::make_shared<Row>(*static_cast<Row*>(row.get()));
+        }
+        return *static_cast<Row*>(row.get());
+    }
+
+    static void insertSorted(Row& row, int userId) {
+        auto it = std::lower_bound(row.begin(), row.end(), userId);
+        if (it == row.end() || *it != userId) {
+            row.insert(it, userId);
+        }
+    }
+
+    static void eraseSorted(Row& row, int userId) {
+        auto it = std::lower_bound(row.begin(), row.end(), userId);
+        if (it != row.end() && *it == userId) {
+            row.erase(it);
+        }
+    }
+};
+
+// Graph whose neighbour arrays stay on disk. Offsets and user ids (about 12
+// bytes per user) are kept in memory; the concatenated CSR rows are either
+// memory-mapped or read with pread. Before each BFS level the rows the level
+// will touch are sorted by file offset and coalesced into ranges, which are
+// announced with madvise(MADV_WILLNEED) or read in large batched preads, so
+// the disk sees few big sequential requests instead of one fault per row.
+//
+// File layout: "SMSE", uint32 version, uint64 users, uint64 entries,
+// int32 ids[users], uint64 offsets[users + 1], padding to 4096 bytes,
+// int32 neighbours[entries] (as vertex indices).
+class SemiExternalGraph {
+public:
+    enum class AccessMode { Mmap, Pread };
+
+    struct Stats {
+        size_t rowsRequested = 0;
+        size_t prefetchRanges = 0;          // madvise calls or batched preads
+        size_t bytesPrefetched = 0;
+    };
+
+    // Alignment of the neighbour array in the file; independent of the
+    // page size of the machine that maps it
+    static constexpr size_t headerAlignment = 4096;
+
+    // Size of the file written for a graph with the given counts
+    static size_t fileBytes(uint64_t users, uint64_t entries) {
+        return headerBytes(users) + entries * sizeof(int32_t);
+    }
+
+    // Write a snapshot in the on-disk layout
+    static void write(const GraphSnapshot& graph, const std::string& path) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot create " + path);
+        }
+        uint64_t users = graph.vertexCount();
+        uint64_t entries = graph.edgeCount();
+        out.write("SMSE", 4);
+        writeBinary<uint32_t>(out, 1);
+        writeBinary<uint64_t>(out, users);
+        writeBinary<uint64_t>(out, entries);
+        for (int id : graph.ids) {
+            writeBinary<int32_t>(out, id);
+        }
+        for (size_t offset : graph.offsets) {
+            writeBinary<uint64_t>(out, offset);
+        }
+        size_t header = headerBytes(users);
+        std::vector<char> padding(header - static_cast<size_t>(out.tellp()), 0);
+        out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+        out.write(reinterpret_cast<const char*>(graph.neighbors.data()),
+                  static_cast<std::streamsize>(entries * sizeof(int32_t)));
+        if (!out) {
+            throw std::runtime_error("Failed to write " + path);
+        }
+    }
+
+    SemiExternalGraph(const std::string& path, AccessMode accessMode = AccessMode::Mmap,
+                      size_t readaheadBytes = 1 << 20)
+        : mode(accessMode), readahead(readaheadBytes), pageSize(static_cast<size_t>(::sysconf(_SC_PAGESIZE))) {
+        std::ifstream in(path, std::ios::binary);
+        char magic[4];
+        if (!in.read(magic, 4) || std::memcmp(magic, "SMSE", 4) != 0) {
+            throw std::runtime_error(path + " is not a semi-external graph");
+        }
+        if (readBinary<uint32_t>(in) != 1) {
+            throw std::runtime_error("Unsupported semi-external graph version");
+        }
+        uint64_t users = readBinary<uint64_t>(in);
+        entries = readBinary<uint64_t>(in);
+        ids.resize(users);
+        for (int& id : ids) {
+            id = readBinary<int32_t>(in);
+        }
+        offsets.resize(users + 1);
+        for (uint64_t& offset : offsets) {
+            offset = readBinary<uint64_t>(in);
+        }
+        index.reserve(users);
+        for (size_t v = 0; v < users; v++) {
+            index[ids[v]] = static_cast<int>(v);
+        }
+        dataStart = headerBytes(users);
+
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        if (mode == AccessMode::Mmap && entries > 0) {
+            // Mapped from offset 0: dataStart need not be a multiple of the
+            // page size, which can be 16K or 64K
+            mappedBytes = dataStart + entries * sizeof(int32_t);
+            void* address = ::mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (address == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map " + path + ": " + std::strerror(errno));
+            }
+            mappedFile = static_cast<const char*>(address);
+            mapped = reinterpret_cast<const int32_t*>(mappedFile + dataStart);
+            // Rows are fetched explicitly; the kernel's sequential readahead would only waste I/O
+            ::madvise(address, mappedBytes, MADV_RANDOM);
+        }
+    }
+
+    SemiExternalGraph(const SemiExternalGraph&) = delete;
+    SemiExternalGraph& operator=(const SemiExternalGraph&) = delete;
+
+    ~SemiExternalGraph() {
+        if (mappedFile) {
+            ::munmap(const_cast<char*>(mappedFile), mappedBytes);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    size_t vertexCount() const { return ids.size(); }
+    bool hasUser(int userId) const { return index.count(userId) > 0; }
+    const Stats& stats() const { return counters; }
+
+    template <typename Fn>
+    void forEachFriend(int userId, Fn fn) const {
+        auto it = index.find(userId);
+        if (it == index.end()) {
+            return;
+        }
+        RowBatch batch = fetch({it->second});
+        for (int neighbor : batch.row(0)) {
+            fn(ids[neighbor]);
+        }
+    }
+
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) const {
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it == index.end()) {
+            return recommendations;
+        }
+        int source = it->second;
+        std::vector<int> friends = fetch({source}).rowVector(0);
+        std::unordered_map<int, int> potentialFriends;
+        forEachRow(friends, [&](size_t, RowBatch::Span row) {
+            for (int candidate : row) {
+                if (candidate != source && !std::binary_search(friends.begin(), friends.end(), candidate)) {
+                    potentialFriends[candidate]++;
+                }
+            }
+        });
+        for (const auto& entry : potentialFriends) {
+            recommendations.push_back({ids[entry.first], entry.second});
+        }
+        std::sort(recommendations.begin(), recommendations.end(),
+            [](const auto& a, const auto& b) {
+                return a.second > b.second;
+            });
+        return recommendations;
+    }
+
+    // Level-synchronous BFS; memory is one bit per user plus the frontiers
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(int userId, int maxDistance) const {
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it == index.end()) {
+            return recommendations;
+        }
+        int source = it->second;
+        Bitmap visited;
+        visited.resize(vertexCount());
+        visited.set(source);
+        std::vector<int> frontier = {source};
+
+        for (int distance = 0; distance <= maxDistance && !frontier.empty(); distance++) {
+            std::vector<int> next;
+            forEachRow(frontier, [&](size_t, RowBatch::Span row) {
+                for (int neighbor : row) {
+                    // Friends are marked at distance 0 and so never recommended
+                    if (!visited.test(neighbor)) {
+                        visited.set(neighbor);
+                        next.push_back(neighbor);
+                        if (distance > 0) {
+                            recommendations.push_back({ids[neighbor], distance + 1});
+                        }
+                    }
+                }
+            });
+            frontier.swap(next);
+        }
+        return recommendations;
+    }
+
+private:
+    // Rows fetched for a list of vertices, in the order requested
+    struct RowBatch {
+        struct Span {
+            const int32_t* first;
+            const int32_t* last;
+            const int32_t* begin() const { return first; }
+            const int32_t* end() const { return last; }
+        };
+        std::vector<Span> spans;
+        std::vector<int32_t> storage;       // pread mode only
+
+        Span row(size_t i) const { return spans[i]; }
+        std::vector<int> rowVector(size_t i) const {
+            std::vector<int> values(spans[i].first, spans[i].last);
+            std::sort(values.begin(), values.end());
+            return values;
+        }
+    };
+
+    AccessMode mode;
+    size_t readahead;
+    CountedVector<int, MemoryCategory::Snapshots> ids;
+    CountedMap<int, int, MemoryCategory::Snapshots> index;
+    std::vector<uint64_t> offsets;
+    uint64_t entries = 0;
+    size_t pageSize;                        // of this machine, for madvise and coalescing
+    size_t dataStart = 0;
+    int fd = -1;
+    const char* mappedFile = nullptr;
+    const int32_t* mapped = nullptr;        // neighbour array within mappedFile
+    size_t mappedBytes = 0;
+    mutable Stats counters;
+
+    static size_t headerBytes(uint64_t users) {
+        size_t bytes = 4 + sizeof(uint32_t) + 2 * sizeof(uint64_t) +
+                       users * sizeof(int32_t) + (users + 1) * sizeof(uint64_t);
+        return (bytes + headerAlignment - 1) / headerAlignment * headerAlignment;
+    }
+
+    size_t rowBytes(int vertex) const {
+        return static_cast<size_t>(offsets[vertex + 1] - offsets[vertex]) * sizeof(int32_t);
+    }
+
+    // Call fn(position, row) for the rows of the given vertices, fetched in
+    // windows so at most `readahead` bytes (or one larger row) are in flight
+    template <typename Fn>
+    void forEachRow(const std::vector<int>& vertices, Fn fn) const {
+        for (size_t start = 0; start < vertices.size();) {
+            size_t end = start;
+            size_t bytes = 0;
+            while (end < vertices.size() && (end == start || bytes < readahead)) {
+                bytes += rowBytes(vertices[end]);
+                end++;
+            }
+            std::vector<int> window(vertices.begin() + start, vertices.begin() + end);
+            RowBatch batch = fetch(window);
+            for (size_t i = 0; i < window.size(); i++) {
+                fn(start + i, batch.row(i));
+            }
+            start = end;
+        }
+    }
+
+    // Coalesced [first, last) entry ranges covering the rows of the given vertices
+    std::vector<std::pair<uint64_t, uint64_t>> coalesce(const std::vector<int>& vertices) const {
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        for (int v : vertices) {
+            if (offsets[v + 1] > offsets[v]) {
+                ranges.push_back({offsets[v], offsets[v + 1]});
+            }
+        }
+        std::sort(ranges.begin(), ranges.end());
+        // Gaps smaller than a page cost nothing extra to read through
+        uint64_t gap = pageSize / sizeof(int32_t);
+        size_t kept = 0;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (kept > 0 && ranges[i].first <= ranges[kept - 1].second + gap) {
+                ranges[kept - 1].second = std::max(ranges[kept - 1].second, ranges[i].second);
+            } else {
+                ranges[kept++] = ranges[i];
+            }
+        }
+        ranges.resize(kept);
+        return ranges;
+    }
+
+    RowBatch fetch(const std::vector<int>& vertices) const {
+        RowBatch batch;
+        batch.spans.reserve(vertices.size());
+        counters.rowsRequested += vertices.size();
+        auto ranges = coalesce(vertices);
+
+        if (mode == AccessMode::Mmap) {
+            for (const auto& range : ranges) {
+                uintptr_t first = reinterpret_cast<uintptr_t>(mapped + range.first) & ~(pageSize - 1);
+                uintptr_t last = reinterpret_cast<uintptr_t>(mapped + range.second);
+                if (ranges.size() > 1 || last - first > pageSize) {
+                    ::madvise(reinterpret_cast<void*>(first), last - first, MADV_WILLNEED);
+                    counters.prefetchRanges++;
+                    counters.bytesPrefetched += last - first;
+                }
+            }
+            for (int v : vertices) {
+                batch.spans.push_back({mapped + offsets[v], mapped + offsets[v + 1]});
+            }
+            return batch;
+        }
+
+        // pread mode: one read per coalesced range into a private buffer
+        size_t total = 0;
+        for (const auto& range : ranges) {
+            total += range.second - range.first;
+        }
+        batch.storage.resize(total);
+        std::vector<std::pair<uint64_t, size_t>> placed;    // range start -> position in storage
+        size_t position = 0;
+        for (const auto& range : ranges) {
+            size_t bytes = (range.second - range.first) * sizeof(int32_t);
+            off_t fileOffset = static_cast<off_t>(dataStart + range.first * sizeof(int32_t));
+            char* target = reinterpret_cast<char*>(batch.storage.data() + position);
+            size_t done = 0;
+            while (done < bytes) {
+                ssize_t got = ::pread(fd, target + done, bytes - done, fileOffset + static_cast<off_t>(done));
+                if (got <= 0) {
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("Semi-external read failed: ") + std::strerror(errno));
+                }
+                done += static_cast<size_t>(got);
+            }
+            placed.push_back({range.first, position});
+            position += range.second - range.first;
+            counters.prefetchRanges++;
+            counters.bytesPrefetched += bytes;
+        }
+        for (int v : vertices) {
+            if (offsets[v + 1] == offsets[v]) {
+                batch.spans.push_back({nullptr, nullptr});
+                continue;
+            }
+            auto range = std::upper_bound(placed.begin(), placed.end(), std::make_pair(offsets[v], SIZE_MAX)) - 1;
+            const int32_t* first = batch.storage.data() + range->second + (offsets[v] - range->first);
+            batch.spans.push_back({first, first + (offsets[v + 1] - offsets[v])});
+        }
+        return batch;
+    }
+};
+
+// CPUs of each NUMA node, read from /sys/devices/system/node and restricted
+// to the CPUs this process may run on. Machines without that directory (or
+// with a single node) get one node holding every allowed CPU.
+struct NumaTopology {
+    struct Node {
+        int id = 0;
+        std::vector<int> cpus;
+    };
+    std::vector<Node> nodes;
+
+    // Parse a kernel cpu/node list such as "0-3,8,10-11"
+    static std::vector<int> parseList(const std::string& text) {
+        std::vector<int> values;
+        std::stringstream stream(text);
+        std::string part;
+        while (std::getline(stream, part, ',')) {
+            if (part.empty() || part == "\n") {
+                continue;
+            }
+            size_t dash = part.find('-');
+            int first = std::atoi(part.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(part.c_str() + dash + 1);
+            for (int value = first; value <= last; value++) {
+                values.push_back(value);
+            }
+        }
+        return values;
+    }
+
+    static std::vector<int> allowedCpus() {
+        std::vector<int> cpus;
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &mask)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        if (cpus.empty()) {
+            for (size_t cpu = 0; cpu < hardwareThreads(); cpu++) {
+                cpus.push_back(static_cast<int>(cpu));
+            }
+        }
+        return cpus;
+    }
+
+    static NumaTopology detect() {
+        NumaTopology topology;
+        std::vector<int> allowed = allowedCpus();
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string line;
+        if (online && std::getline(online, line)) {
+            for (int nodeId : parseList(line)) {
+                std::ifstream cpuList("/sys/devices/system/node/node" + std::to_string(nodeId) + "/cpulist");
+                std::string cpuLine;
+                if (!cpuList || !std::getline(cpuList, cpuLine)) {
+                    continue;
+                }
+                Node node;
+                node.id = nodeId;
+                for (int cpu : parseList(cpuLine)) {
+                    if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                // Memory-only nodes and nodes outside our cpuset cannot run workers
+                if (!node.cpus.empty()) {
+                    topology.nodes.push_back(node);
+                }
+            }
+        }
+        if (topology.nodes.empty()) {
+            topology.nodes.push_back({0, allowed});
+        }
+        return topology;
+    }
+
+    // Split the allowed CPUs into nodeCount pretend nodes, to exercise the
+    // partitioned code paths on single-node machines
+    static NumaTopology simulated(size_t nodeCount) {
+        NumaTopology topology;
+        std::vector<int> allowed = allowedCpus();
+        nodeCount = std::max<size_t>(1, nodeCount);
+        for (size_t i = 0; i < nodeCount; i++) {
+            Node node;
+            node.id = static_cast<int>(i);
+            for (size_t c = i; c < allowed.size(); c += nodeCount) {
+                node.cpus.push_back(allowed[c]);
+            }
+            if (node.cpus.empty()) {
+                node.cpus.push_back(allowed[i % allowed.size()]);
+            }
+            topology.nodes.push_back(node);
+        }
+        return topology;
+    }
+};
+
+// Restrict the calling thread to the given CPUs; returns false if the kernel refused
+inline bool pinCurrentThread(const std::vector<int>& cpus) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &mask);
+        }
+    }
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
+
+// Read-only graph split into one contiguous vertex range per NUMA node,
+// balanced by edge count. Each partition's offsets and rows are allocated
+// and first touched by a thread pinned to its node, so the kernel places the
+// pages locally. Queries run on worker threads pinned to the node owning the
+// source user; rows read from other partitions are counted as remote traffic.
+class NumaPartitionedGraph {
+public:
+    struct NodeTraffic {
+        int node = 0;
+        uint64_t localBytes = 0;
+        uint64_t remoteBytes = 0;
+        uint64_t queries = 0;
+    };
+
+    NumaPartitionedGraph(const GraphSnapshot& graph, NumaTopology numaTopology = NumaTopology::detect())
+        : topology(std::move(numaTopology)), ids(graph.ids), index(graph.index) {
+        size_t nodeCount = topology.nodes.size();
+        partitions.resize(nodeCount);
+        traffic.reset(new TrafficCounters[nodeCount]);
+
+        // Contiguous ranges holding about edgeCount / nodeCount entries each
+        size_t n = graph.vertexCount();
+        size_t vertex = 0;
+        for (size_t p = 0; p < nodeCount; p++) {
+            partitions[p].first = static_cast<int>(vertex);
+            size_t target = graph.edgeCount() * (p + 1) / nodeCount;
+            while (vertex < n && (p + 1 == nodeCount || graph.offsets[vertex + 1] <= target)) {
+                vertex++;
+            }
+            partitions[p].last = static_cast<int>(vertex);
+            bounds.push_back(partitions[p].last);
+        }
+
+        std::vector<std::thread> builders;
+        for (size_t p = 0; p < nodeCount; p++) {
+            builders.emplace_back([this, &graph, p]() {
+                pinCurrentThread(topology.nodes[p].cpus);
+                Partition& part = partitions[p];
+                size_t base = graph.offsets[part.first];
+                part.offsets.resize(part.last - part.first + 1);
+                for (int v = part.first; v <= part.last; v++) {
+                    part.offsets[v - part.first] = graph.offsets[v] - base;
+                }
+                part.neighbors.assign(graph.neighbors.begin() + base,
+                                      graph.neighbors.begin() + graph.offsets[part.last]);
+            });
+        }
+        for (auto& builder : builders) {
+            builder.join();
+        }
+
+        // All lanes exist before any worker starts reading the vector
+        for (size_t p = 0; p < nodeCount; p++) {
+            lanes.emplace_back(new Lane());
+        }
+        for (size_t p = 0; p < nodeCount; p++) {
+            size_t workers = std::max<size_t>(1, std::min(topology.nodes[p].cpus.size(), hardwareThreads()));
+            for (size_t w = 0; w < workers; w++) {
+                lanes[p]->threads.emplace_back([this, p]() { workerLoop(p); });
+            }
+        }
+    }
+
+    NumaPartitionedGraph(const NumaPartitionedGraph&) = delete;
+    NumaPartitionedGraph& operator=(const NumaPartitionedGraph&) = delete;
+
+    ~NumaPartitionedGraph() {
+        for (auto& lane : lanes) {
+            {
+                std::lock_guard<std::mutex> lock(lane->mutex);
+                lane->stopping = true;
+            }
+            lane->wake.notify_all();
+            for (auto& thread : lane->threads) {
+                thread.join();
+            }
+        }
+    }
+
+    size_t nodeCount() const { return partitions.size(); }
+    bool hasUser(int userId) const { return index.count(userId) > 0; }
+
+    // Node owning a user's adjacency, or -1 for unknown users
+    int nodeOf(int userId) const {
+        auto it = index.find(userId);
+        return it == index.end() ? -1 : static_cast<int>(partitionOf(it->second));
+    }
+
+    // Route queries to the owning node (default) or spread them round-robin,
+    // which is what an unpartitioned thread pool would do
+    void setRouting(bool routeToOwner) { routed = routeToOwner; }
+
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) {
+        return submit(userId, [this, userId](size_t lane) { return commonFriends(userId, lane); }).get();
+    }
+
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(int userId, int maxDistance) {
+        return submit(userId, [this, userId, maxDistance](size_t lane) {
+            return networkDistance(userId, maxDistance, lane);
+        }).get();
+    }
+
+    // Run a batch of distance queries concurrently across the node workers
+    std::vector<std::vector<std::pair<int, int>>> recommendBatchByNetworkDistance(
+        const std::vector<int>& userIds, int maxDistance) {
+        std::vector<std::future<std::vector<std::pair<int, int>>>> pending;
+        pending.reserve(userIds.size());
+        for (int userId : userIds) {
+            pending.push_back(submit(userId, [this, userId, maxDistance](size_t lane) {
+                return networkDistance(userId, maxDistance, lane);
+            }));
+        }
+        std::vector<std::vector<std::pair<int, int>>> results;
+        results.reserve(pending.size());
+        for (auto& result : pending) {
+            results.push_back(result.get());
+        }
+        return results;
+    }
+
+    std::vector<NodeTraffic> trafficByNode() const {
+        std::vector<NodeTraffic> result(nodeCount());
+        for (size_t p = 0; p < nodeCount(); p++) {
+            result[p].node = topology.nodes[p].id;
+            result[p].localBytes = traffic[p].localBytes.load();
+            result[p].remoteBytes = traffic[p].remoteBytes.load();
+            result[p].queries = traffic[p].queries.load();
+        }
+        return result;
+    }
+
+    void resetTraffic() {
+        for (size_t p = 0; p < nodeCount(); p++) {
+            traffic[p].localBytes = 0;
+            traffic[p].remoteBytes = 0;
+            traffic[p].queries = 0;
+        }
+    }
+
+private:
+    struct Partition {
+        int first = 0;                      // vertex range [first, last)
+        int last = 0;
+        std::vector<size_t> offsets;        // relative to neighbors, size last - first + 1
+        std::vector<int> neighbors;         // global vertex indices
+    };
+
+    struct alignas(64) TrafficCounters {
+        std::atomic<uint64_t> localBytes{0};
+        std::atomic<uint64_t> remoteBytes{0};
+        std::atomic<uint64_t> queries{0};
+    };
+
+    struct Lane {
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        bool stopping = false;
+    };
+
+    // Bytes read by one query, split by where they live
+    struct Reads {
+        size_t lane;
+        uint64_t local = 0;
+        uint64_t remote = 0;
+    };
+
+    NumaTopology topology;
+    CountedVector<int, MemoryCategory::Snapshots> ids;
+    CountedMap<int, int, MemoryCategory::Snapshots> index;
+    std::vector<Partition> partitions;
+    std::vector<int> bounds;                // partitions[p].last, for owner lookup
+    std::unique_ptr<TrafficCounters[]> traffic;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::atomic<size_t> nextLane{0};
+    bool routed = true;
+
+    size_t partitionOf(int vertex) const {
+        return static_cast<size_t>(std::upper_bound(bounds.begin(), bounds.end(), vertex) - bounds.begin());
+    }
+
+    void workerLoop(size_t lane) {
+        pinCurrentThread(topology.nodes[lane].cpus);
+        Lane& self = *lanes[lane];
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(self.mutex);
+                self.wake.wait(lock, [&self]() { return self.stopping || !self.tasks.empty(); });
+                if (self.tasks.empty()) {
+                    return;
+                }
+                task = std::move(self.tasks.front());
+                self.tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    template <typename Fn>
+    std::future<std::vector<std::pair<int, int>>> submit(int userId, Fn fn) {
+        int owner = nodeOf(userId);
+        size_t lane = routed && owner >= 0 ? static_cast<size_t>(owner) : nextLane++ % nodeCount();
+        auto task = std::make_shared<std::packaged_task<std::vector<std::pair<int, int>>()>>(
+            [fn, lane]() { return fn(lane); });
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(lanes[lane]->mutex);
+            lanes[lane]->tasks.push_back([task]() { (*task)(); });
+        }
+        lanes[lane]->wake.notify_one();
+        return result;
+    }
+
+    // Neighbour row of a vertex, charging its bytes to local or remote traffic
+    std::pair<const int*, const int*> row(int vertex, Reads& reads) const {
+        size_t p = partitionOf(vertex);
+        const Partition& part = partitions[p];
+        size_t first = part.offsets[vertex - part.first];
+        size_t last = part.offsets[vertex - part.first + 1];
+        uint64_t bytes = 2 * sizeof(size_t) + (last - first) * sizeof(int);
+        (p == reads.lane ? reads.local : reads.remote) += bytes;
+        return {part.neighbors.data() + first, part.neighbors.data() + last};
+    }
+
+    void record(const Reads& reads) {
+        traffic[reads.lane].localBytes += reads.local;
+        traffic[reads.lane].remoteBytes += reads.remote;
+        traffic[reads.lane].queries++;
+    }
+
+    std::vector<std::pair<int, int>> commonFriends(int userId, size_t lane) {
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it == index.end()) {
+            return recommendations;
+        }
+        Reads reads{lane};
+        int source = it->second;
+        auto friends = row(source, reads);
+        std::unordered_map<int, int> potentialFriends;
+        for (const int* f = friends.first; f != friends.second; ++f) {
+            auto candidates = row(*f, reads);
+            for (const int* c = candidates.first; c != candidates.second; ++c) {
+                if (*c != source && !std::binary_search(friends.first, friends.second, *c)) {
+                    potentialFriends[*c]++;
+                }
+            }
+        }
+        record(reads);
+        for (const auto& entry : potentialFriends) {
+            recommendations.push_back({ids[entry.first], entry.second});
+        }
+        std::sort(recommendations.begin(), recommendations.end(),
+            [](const auto& a, const auto& b) {
+                return a.second > b.second;
+            });
+        return recommendations;
+    }
+
+    std::vector<std::pair<int, int>> networkDistance(int userId, int maxDistance, size_t lane) {
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it == index.end()) {
+            return recommendations;
+        }
+        Reads reads{lane};
+        Bitmap visited;
+        visited.resize(ids.size());
+        visited.set(it->second);
+        std::vector<int> frontier = {it->second};
+        for (int distance = 0; distance <= maxDistance && !frontier.empty(); distance++) {
+            std::vector<int> next;
+            for (int current : frontier) {
+                auto neighbors = row(current, reads);
+                for (const int* n = neighbors.first; n != neighbors.second; ++n) {
+                    // Friends are marked at distance 0 and so never recommended
+                    if (!visited.test(*n)) {
+                        visited.set(*n);
+                        next.push_back(*n);
+                        if (distance > 0) {
+                            recommendations.push_back({ids[*n], distance + 1});
+                        }
+                    }
+                }
+            }
+            frontier.swap(next);
+        }
+        record(reads);
+        return recommendations;
+    }
+};
+
+// Communication of one partitioned query, as seen by the coordinator
+struct ClusterStats {
+    size_t rounds = 0;                      // bulk-synchronous supersteps
+    size_t messages = 0;                    // frames sent and received
+    size_t bytes = 0;                       // frame headers and payloads
+};
+
+// Edge-cut partitioned execution across local worker processes. Each
+// worker is forked with one contiguous, edge-balanced vertex range; its rows
+// reference neighbours owned elsewhere (ghost vertices), whose owner follows
+// from the range bounds. Queries run as bulk-synchronous rounds: the
+// coordinator sends every worker the vertices it must handle this round over
+// a Unix socketpair, workers answer with locally combined results, and the
+// coordinator routes the next round's messages to their owners.
+class PartitionedCluster {
+public:
+    struct WorkerInfo {
+        pid_t pid = 0;
+        int firstVertex = 0;
+        int lastVertex = 0;
+        uint64_t entries = 0;
+        uint64_t ghosts = 0;                // distinct remote vertices referenced by owned rows
+    };
+
+    PartitionedCluster(const GraphSnapshot& graph, size_t workerCount)
+        : ids(graph.ids), index(graph.index) {
+        workerCount = std::max<size_t>(1, std::min(workerCount, std::max<size_t>(1, graph.vertexCount())));
+        size_t n = graph.vertexCount();
+        size_t vertex = 0;
+        for (size_t w = 0; w < workerCount; w++) {
+            size_t target = graph.edgeCount() * (w + 1) / workerCount;
+            while (vertex < n && (w + 1 == workerCount || graph.offsets[vertex + 1] <= target)) {
+                vertex++;
+            }
+            bounds.push_back(static_cast<int>(vertex));
+        }
+
+        for (size_t w = 0; w < workerCount; w++) {
+            int pair[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+                shutdown();
+                throw std::runtime_error(std::string("socketpair failed: ") + std::strerror(errno));
+            }
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                ::close(pair[0]);
+                ::close(pair[1]);
+                shutdown();
+                throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+            }
+            if (pid == 0) {
+                ::close(pair[0]);
+                for (const Worker& other : workers) {
+                    ::close(other.fd);
+                }
+                int status = 0;
+                try {
+                    int first = w == 0 ? 0 : bounds[w - 1];
+                    serve(Partition(graph, first, bounds[w]), pair[1]);
+                } catch (...) {
+                    status = 1;
+                }
+                ::_exit(status);
+            }
+            ::close(pair[1]);
+            workers.push_back({pid, pair[0]});
+        }
+    }
+
+    PartitionedCluster(const PartitionedCluster&) = delete;
+    PartitionedCluster& operator=(const PartitionedCluster&) = delete;
+
+    ~PartitionedCluster() {
+        shutdown();
+    }
+
+    size_t workerCount() const { return workers.size(); }
+    bool hasUser(int userId) const { return index.count(userId) > 0; }
+
+    std::vector<WorkerInfo> describe() {
+        std::vector<WorkerInfo> result;
+        ClusterStats ignored;
+        for (size_t w = 0; w < workers.size(); w++) {
+            sendFrame(w, Describe, {}, ignored);
+            std::vector<int32_t> reply = receiveFrame(w, ignored);
+            WorkerInfo info;
+            info.pid = workers[w].pid;
+            info.firstVertex = w == 0 ? 0 : bounds[w - 1];
+            info.lastVertex = bounds[w];
+            auto count = [&reply](size_t i) {
+                return static_cast<uint64_t>(static_cast<uint32_t>(reply.at(2 * i))) |
+                       static_cast<uint64_t>(static_cast<uint32_t>(reply.at(2 * i + 1))) << 32;
+            };
+            info.entries = count(0);
+            info.ghosts = count(1);
+            result.push_back(info);
+        }
+        return result;
+    }
+
+    // Two rounds: the owner of the user returns its friends, then every
+    // worker counts the friends-of-friends reachable through the friends it
+    // owns and returns one (candidate, count) pair per distinct candidate
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId, ClusterStats* stats = nullptr) {
+        ClusterStats local;
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it != index.end()) {
+            int source = it->second;
+            size_t owner = ownerOf(source);
+            sendFrame(owner, Row, {source}, local);
+            std::vector<int32_t> friends = receiveFrame(owner, local);
+            local.rounds++;
+
+            std::vector<std::vector<int32_t>> byOwner = groupByOwner(friends);
+            for (size_t w = 0; w < workers.size(); w++) {
+                if (!byOwner[w].empty()) {
+                    sendFrame(w, CountThrough, byOwner[w], local);
+                }
+            }
+            std::sort(friends.begin(), friends.end());
+            std::unordered_map<int, int> potentialFriends;
+            for (size_t w = 0; w < workers.size(); w++) {
+                if (byOwner[w].empty()) {
+                    continue;
+                }
+                std::vector<int32_t> counts = receiveFrame(w, local);
+                for (size_t i = 0; i + 1 < counts.size(); i += 2) {
+                    int candidate = counts[i];
+                    if (candidate != source && !std::binary_search(friends.begin(), friends.end(), candidate)) {
+                        potentialFriends[candidate] += counts[i + 1];
+                    }
+                }
+            }
+            local.rounds++;
+
+            for (const auto& entry : potentialFriends) {
+                recommendations.push_back({ids[entry.first], entry.second});
+            }
+            std::sort(recommendations.begin(), recommendations.end(),
+                [](const auto& a, const auto& b) {
+                    return a.second > b.second;
+                });
+        }
+        if (stats) {
+            *stats = local;
+        }
+        return recommendations;
+    }
+
+    // Level-synchronous BFS; each worker keeps the visited bits of its own
+    // vertices, so a round delivers candidate vertices to their owners, which
+    // keep the unseen ones and answer with their deduplicated neighbours.
+    // Results are ordered by distance, then user id.
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(int userId, int maxDistance,
+                                                                ClusterStats* stats = nullptr) {
+        ClusterStats local;
+        std::vector<std::pair<int, int>> recommendations;
+        auto it = index.find(userId);
+        if (it != index.end()) {
+            for (size_t w = 0; w < workers.size(); w++) {
+                sendFrame(w, BfsReset, {}, local);
+            }
+            std::vector<std::vector<int32_t>> deliveries(workers.size());
+            deliveries[ownerOf(it->second)].push_back(it->second);
+
+            // Vertices first seen at level `level`; friends are level 1 and never recommended
+            for (int level = 0; level <= maxDistance + 1; level++) {
+                uint32_t flags = level <= maxDistance ? ExpandFlag : 0;
+                bool any = false;
+                for (size_t w = 0; w < workers.size(); w++) {
+                    if (!deliveries[w].empty()) {
+                        sendFrame(w, BfsStep, deliveries[w], local, flags);
+                        any = true;
+                    }
+                }
+                if (!any) {
+                    break;
+                }
+                std::vector<std::vector<int32_t>> next(workers.size());
+                for (size_t w = 0; w < workers.size(); w++) {
+                    if (deliveries[w].empty()) {
+                        continue;
+                    }
+                    std::vector<int32_t> visited = receiveFrame(w, local);
+                    std::vector<int32_t> outgoing = receiveFrame(w, local);
+                    if (level >= 2) {
+                        for (int vertex : visited) {
+                            recommendations.push_back({ids[vertex], level});
+                        }
+                    }
+                    for (int vertex : outgoing) {
+                        next[ownerOf(vertex)].push_back(vertex);
+                    }
+                }
+                local.rounds++;
+                deliveries.swap(next);
+            }
+            std::sort(recommendations.begin(), recommendations.end(),
+                [](const auto& a, const auto& b) {
+                    return a.second != b.second ? a.second < b.second : a.first < b.first;
+                });
+        }
+        if (stats) {
+            *stats = local;
+        }
+        return recommendations;
+    }
+
+private:
+    enum Op : uint32_t { Row = 1, CountThrough, BfsReset, BfsStep, Describe, Shutdown };
+    static constexpr uint32_t ExpandFlag = 1;
+
+    struct FrameHeader {
+        uint32_t op;
+        uint32_t flags;
+        uint64_t count;                     // int32 payload entries
+    };
+
+    struct Worker {
+        pid_t pid;
+        int fd;
+    };
+
+    // The rows a worker owns, with neighbours as global vertex indices
+    struct Partition {
+        int first;
+        int last;
+        std::vector<size_t> offsets;
+        std::vector<int> neighbors;
+        std::vector<uint8_t> visited;
+        std::vector<int> touched;
+
+        Partition(const GraphSnapshot& graph, int firstVertex, int lastVertex)
+            : first(firstVertex), last(lastVertex), visited(lastVertex - firstVertex, 0) {
+            size_t base = graph.offsets[first];
+            for (int v = first; v <= last; v++) {
+                offsets.push_back(graph.offsets[v] - base);
+            }
+            neighbors.assign(graph.neighbors.begin() + base, graph.neighbors.begin() + graph.offsets[last]);
+        }
+
+        const int* begin(int vertex) const { return neighbors.data() + offsets[vertex - first]; }
+        const int* end(int vertex) const { return neighbors.data() + offsets[vertex - first + 1]; }
+    };
+
+    CountedVector<int, MemoryCategory::Snapshots> ids;
+    CountedMap<int, int, MemoryCategory::Snapshots> index;
+    std::vector<int> bounds;                // last vertex (exclusive) of each worker
+    std::vector<Worker> workers;
+
+    size_t ownerOf(int vertex) const {
+        return static_cast<size_t>(std::upper_bound(bounds.begin(), bounds.end(), vertex) - bounds.begin());
+    }
+
+    std::vector<std::vector<int32_t>> groupByOwner(const std::vector<int32_t>& vertices) const {
+        std::vector<std::vector<int32_t>> groups(workers.size());
+        for (int vertex : vertices) {
+            groups[ownerOf(vertex)].push_back(vertex);
+        }
+        return groups;
+    }
+
+    static void writeAll(int fd, const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            ssize_t written = ::send(fd, bytes, size, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("Cluster send failed: ") + std::strerror(errno));
+            }
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    static void readAll(int fd, void* data, size_t size) {
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t got = ::recv(fd, bytes, size, 0);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error("Cluster connection closed");
+            }
+            bytes += got;
+            size -= static_cast<size_t>(got);
+        }
+    }
+
+    static size_t writeFrame(int fd, uint32_t op, const std::vector<int32_t>& payload, uint32_t flags = 0) {
+        FrameHeader header{op, flags, payload.size()};
+        writeAll(fd, &header, sizeof(header));
+        writeAll(fd, payload.data(), payload.size() * sizeof(int32_t));
+        return sizeof(header) + payload.size() * sizeof(int32_t);
+    }
+
+    static FrameHeader readFrame(int fd, std::vector<int32_t>& payload) {
+        FrameHeader header;
+        readAll(fd, &header, sizeof(header));
+        payload.resize(header.count);
+        readAll(fd, payload.data(), payload.size() * sizeof(int32_t));
+        return header;
+    }
+
+    void sendFrame(size_t worker, uint32_t op, const std::vector<int32_t>& payload, ClusterStats& stats,
+                   uint32_t flags = 0) {
+        stats.bytes += writeFrame(workers[worker].fd, op, payload, flags);
+        stats.messages++;
+    }
+
+    std::vector<int32_t> receiveFrame(size_t worker, ClusterStats& stats) {
+        std::vector<int32_t> payload;
+        readFrame(workers[worker].fd, payload);
+        stats.bytes += sizeof(FrameHeader) + payload.size() * sizeof(int32_t);
+        stats.messages++;
+        return payload;
+    }
+
+    // Worker process main loop
+    static void serve(Partition part, int fd) {
+        std::vector<int32_t> request;
+        std::unordered_map<int, int> counts;
+        for (;;) {
+            FrameHeader header = readFrame(fd, request);
+            switch (header.op) {
+            case Row: {
+                writeFrame(fd, Row, std::vector<int32_t>(part.begin(request.at(0)), part.end(request.at(0))));
+                break;
+            }
+            case CountThrough: {
+                // Combine locally so each candidate crosses the socket once
+                counts.clear();
+                for (int friendVertex : request) {
+                    for (const int* c = part.begin(friendVertex); c != part.end(friendVertex); ++c) {
+                        counts[*c]++;
+                    }
+                }
+                std::vector<int32_t> reply;
+                reply.reserve(2 * counts.size());
+                for (const auto& entry : counts) {
+                    reply.push_back(entry.first);
+                    reply.push_back(entry.second);
+                }
+                writeFrame(fd, CountThrough, reply);
+                break;
+            }
+            case BfsReset: {
+                for (int vertex : part.touched) {
+                    part.visited[vertex - part.first] = 0;
+                }
+                part.touched.clear();
+                break;
+            }
+            case BfsStep: {
+                std::vector<int32_t> fresh;
+                for (int vertex : request) {
+                    if (!part.visited[vertex - part.first]) {
+                        part.visited[vertex - part.first] = 1;
+                        part.touched.push_back(vertex);
+                        fresh.push_back(vertex);
+                    }
+                }
+                std::vector<int32_t> outgoing;
+                if (header.flags & ExpandFlag) {
+                    for (int vertex : fresh) {
+                        outgoing.insert(outgoing.end(), part.begin(vertex), part.end(vertex));
+                    }
+                    std::sort(outgoing.begin(), outgoing.end());
+                    outgoing.erase(std::unique(outgoing.begin(), outgoing.end()), outgoing.end());
+                }
+                writeFrame(fd, BfsStep, fresh);
+                writeFrame(fd, BfsStep, outgoing);
+                break;
+            }
+            case Describe: {
+                std::vector<int> ghosts;
+                for (int neighbor : part.neighbors) {
+                    if (neighbor < part.first || neighbor >= part.last) {
+                        ghosts.push_back(neighbor);
+                    }
+                }
+                std::sort(ghosts.begin(), ghosts.end());
+                ghosts.erase(std::unique(ghosts.begin(), ghosts.end()), ghosts.end());
+                // Counts are 64-bit; each goes out as low and high 32-bit words
+                uint64_t counts[2] = {part.neighbors.size(), ghosts.size()};
+                std::vector<int32_t> words;
+                for (uint64_t count : counts) {
+                    words.push_back(static_cast<int32_t>(static_cast<uint32_t>(count)));
+                    words.push_back(static_cast<int32_t>(static_cast<uint32_t>(count >> 32)));
+                }
+                writeFrame(fd, Describe, words);
+                break;
+            }
+            case Shutdown:
+                return;
+            default:
+                throw std::runtime_error("Unknown cluster operation");
+            }
+        }
+    }
+
+    void shutdown() {
+        for (const Worker& worker : workers) {
+            try {
+                writeFrame(worker.fd, Shutdown, {});
+            } catch (const std::exception&) {
+                // The worker is already gone; waitpid below still reaps it
+            }
+            ::close(worker.fd);
+            int status = 0;
+            ::waitpid(worker.pid, &status, 0);
+        }
+        workers.clear();
+    }
+};
+
+// Cold-start serving for users with few or no friends. A global list and,
+// optionally, one list per value of a bucket attribute hold the most
+// popular users by PageRank (by degree until PageRank has been computed).
+struct ColdStartConfig {
+    size_t listSize = 50;                   // users kept per list
+    size_t degreeThreshold = 3;             // blend into the results of users with fewer friends
+    size_t blendCount = 10;                 // cold-start users appended per query
+    std::string bucketAttribute;            // e.g. "country"; empty keeps the global list only
+    uint64_t refreshEvery = 10000;          // graph changes between automatic refreshes (0 = manual)
+};
+
+struct ColdStartLists {
+    using List = CountedVector<std::pair<int, float>, MemoryCategory::Caches>;  // (user, popularity), most popular first
+
+    bool enabled = false;
+    List global;
+    CountedMap<std::string, List, MemoryCategory::Caches> buckets;
+    uint64_t builtAtVersion = 0;
+};
+
+// Bounded selection of the most popular users, kept as a min-heap
+class TopList {
+public:
+    explicit TopList(size_t listCapacity) : capacity(listCapacity) {}
+
+    void offer(int userId, float score) {
+        if (capacity == 0) {
+            return;
+        }
+        if (heap.size() < capacity) {
+            heap.push_back({userId, score});
+            std::push_heap(heap.begin(), heap.end(), lessPopular);
+        } else if (lessPopular({userId, score}, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), lessPopular);
+            heap.back() = {userId, score};
+            std::push_heap(heap.begin(), heap.end(), lessPopular);
+        }
+    }
+
+    ColdStartLists::List take() {
+        std::sort(heap.begin(), heap.end(), lessPopular);
+        return std::move(heap);
+    }
+
+private:
+    size_t capacity;
+    ColdStartLists::List heap;
+
+    // Higher score first, then lower user id, so lists are deterministic
+    static bool lessPopular(const std::pair<int, float>& a, const std::pair<int, float>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    }
+};
+
+// Bounded multi-producer multi-consumer queue (Vyukov). Every cell carries a
+// sequence number telling producers and consumers whose turn it is, so push
+// and pop are a single compare-and-swap on their cursor plus one store.
+template <typename T>
+class BoundedMpmcQueue {
+public:
+    // Capacity is rounded up to a power of two, at least 2
+    explicit BoundedMpmcQueue(size_t minimumCapacity) {
+        size_t capacity = 2;
+        while (capacity < minimumCapacity) {
+            capacity *= 2;
+        }
+        mask = capacity - 1;
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    // False if the queue is full
+    bool tryPush(T&& value) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // False if the queue is empty
+    bool tryPop(T& value) {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> enqueuePosition{0};
+    alignas(64) std::atomic<size_t> dequeuePosition{0};
+};
+
+// Change of one user's top-K common-friend list caused by a mutation, or a
+// resync marker after which every list must be re-pulled
+struct RecommendationDelta {
+    int userId = 0;
+    uint64_t version = 0;                   // graph version after the mutation
+    std::vector<std::pair<int, int>> upserted;  // candidates that entered the list or changed count
+    std::vector<int> removed;               // candidates that left the list
+    bool resync = false;                    // the graph was replaced; userId and lists are unused
+};
+
+// Subscriber end of the recommendation change feed. Connection changes
+// (single or batched) publish a delta per list that changed, and so do
+// exclusion changes for the excluding user. Bulk loads (loadSnapshot,
+// loadEdges) publish one resync marker instead of per-user deltas. Deltas
+// that do not fit in the queue are dropped and counted; a consumer that
+// sees a resync marker or dropped() grow should re-pull the lists it caches.
+class ChangeFeed {
+public:
+    ChangeFeed(size_t listSize, size_t queueCapacity) : k(listSize), queue(queueCapacity) {}
+
+    size_t listSize() const { return k; }
+
+    // Next delta, or false if none is pending
+    bool poll(RecommendationDelta& delta) { return queue.tryPop(delta); }
+
+    size_t published() const { return publishedCount.load(std::memory_order_relaxed); }
+    size_t dropped() const { return droppedCount.load(std::memory_order_relaxed); }
+
+    void publish(RecommendationDelta delta) {
+        if (queue.tryPush(std::move(delta))) {
+            publishedCount.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            droppedCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    size_t k;
+    BoundedMpmcQueue<RecommendationDelta> queue;
+    std::atomic<size_t> publishedCount{0};
+    std::atomic<size_t> droppedCount{0};
+};
+
+// CPU time consumed by the calling thread, in seconds
+inline double threadCpuSeconds() {
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) * 1e-9;
+}
+
+// Latest top-K list computed for each user by the background workers
+class PrecomputedStore {
+public:
+    struct Entry {
+        CountedVector<std::pair<int, int>, MemoryCategory::Caches> recommendations;
+        uint64_t version = 0;               // graph version the list was computed at
+    };
+
+    void put(int userId, const std::vector<std::pair<int, int>>& recommendations, uint64_t version) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        Entry& entry = entries[userId];
+        entry.recommendations.assign(recommendations.begin(), recommendations.end());
+        entry.version = version;
+    }
+
+    bool get(int userId, Entry& entry) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = entries.find(userId);
+        if (it == entries.end()) {
+            return false;
+        }
+        entry = it->second;
+        return true;
+    }
+
+    void erase(int userId) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        entries.erase(userId);
+    }
+
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        entries.clear();
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    mutable std::shared_mutex mutex;
+    CountedMap<int, Entry, MemoryCategory::Caches> entries;
+};
+
+// Background recomputation of active users' results. Only users with
+// recorded activity are tracked; their priority is the exponentially decayed
+// activity times the number of mutations that touched their neighbourhood
+// since the last recomputation, so dormant accounts cost nothing and busy
+// users with stale lists go first. Each worker keeps its CPU time (measured
+// with CLOCK_THREAD_CPUTIME_ID) under cpuBudget of one core by sleeping in
+// proportion to the work it just did.
+class PrecomputeScheduler {
+public:
+    struct Config {
+        size_t workers = 1;
+        double cpuBudget = 0.25;            // fraction of one core per worker
+        double activityHalfLifeSeconds = 3600.0;
+    };
+
+    struct Stats {
+        size_t trackedUsers = 0;
+        size_t staleUsers = 0;
+        size_t recomputations = 0;
+        double cpuSeconds = 0.0;
+    };
+
+    PrecomputeScheduler(const Config& schedulerConfig, std::function<void(int)> computeUser)
+        : config(schedulerConfig), compute(std::move(computeUser)), started(std::chrono::steady_clock::now()) {
+        for (size_t w = 0; w < std::max<size_t>(1, config.workers); w++) {
+            workers.emplace_back([this]() { workerLoop(); });
+        }
+    }
+
+    PrecomputeScheduler(const PrecomputeScheduler&) = delete;
+    PrecomputeScheduler& operator=(const PrecomputeScheduler&) = delete;
+
+    ~PrecomputeScheduler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        throttle.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // A user was served or queried; starts tracking unknown users
+    void recordActivity(int userId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        double now = seconds();
+        auto inserted = users.insert({userId, UserState()});
+        UserState& state = inserted.first->second;
+        state.activity = decayedActivity(state, now) + 1.0;
+        state.lastActive = now;
+        if (inserted.second) {
+            state.staleness = 1;            // never computed
+        }
+        enqueue(userId, state);
+    }
+
+    // A mutation touched the neighbourhood of a user; untracked users are ignored
+    void markStale(int userId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = users.find(userId);
+        if (it != users.end()) {
+            it->second.staleness++;
+            it->second.staleSequence++;
+            enqueue(userId, it->second);
+        }
+    }
+
+    void markAllStale() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& entry : users) {
+            entry.second.staleness++;
+            entry.second.staleSequence++;
+            enqueue(entry.first, entry.second);
+        }
+    }
+
+    bool isStale(int userId) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = users.find(userId);
+        return it == users.end() || it->second.staleness > 0;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats result = totals;
+        result.trackedUsers = users.size();
+        for (const auto& entry : users) {
+            result.staleUsers += entry.second.staleness > 0;
+        }
+        return result;
+    }
+
+private:
+    struct UserState {
+        double activity = 0.0;
+        double lastActive = 0.0;
+        uint64_t staleness = 0;             // mutations since the last recomputation
+        uint64_t staleSequence = 0;         // bumped by markStale, detects races with a running job
+        uint64_t epoch = 0;                 // invalidates older heap entries
+    };
+
+    struct QueueEntry {
+        double priority;
+        int userId;
+        uint64_t epoch;
+        bool operator<(const QueueEntry& other) const { return priority < other.priority; }
+    };
+
+    Config config;
+    std::function<void(int)> compute;
+    std::chrono::steady_clock::time_point started;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable throttle;       // budget pauses; only stopping ends them early
+    std::unordered_map<int, UserState> users;
+    std::priority_queue<QueueEntry> queue;  // lazily invalidated through epochs
+    Stats totals;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    double decayedActivity(const UserState& state, double now) const {
+        return state.activity * std::exp2(-(now - state.lastActive) / config.activityHalfLifeSeconds);
+    }
+
+    void enqueue(int userId, UserState& state) {
+        state.epoch++;
+        if (state.staleness == 0) {
+            return;
+        }
+        double priority = decayedActivity(state, seconds()) * static_cast<double>(state.staleness);
+        queue.push({priority, userId, state.epoch});
+        wake.notify_one();
+        // Drop invalidated entries once they dominate the heap
+        if (queue.size() > 2 * users.size() + 1024) {
+            std::priority_queue<QueueEntry> live;
+            while (!queue.empty()) {
+                const QueueEntry& top = queue.top();
+                auto it = users.find(top.userId);
+                if (it != users.end() && it->second.epoch == top.epoch) {
+                    live.push(top);
+                }
+                queue.pop();
+            }
+            queue.swap(live);
+        }
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            wake.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            QueueEntry top = queue.top();
+            queue.pop();
+            auto it = users.find(top.userId);
+            if (it == users.end() || it->second.epoch != top.epoch || it->second.staleness == 0) {
+                continue;
+            }
+            uint64_t sequence = it->second.staleSequence;
+            lock.unlock();
+
+            double cpuBefore = threadCpuSeconds();
+            compute(top.userId);
+            double used = threadCpuSeconds() - cpuBefore;
+
+            lock.lock();
+            it = users.find(top.userId);
+            // A mutation that raced with the job leaves the user queued
+            if (it != users.end() && it->second.staleSequence == sequence) {
+                it->second.staleness = 0;
+                it->second.epoch++;
+            }
+            totals.recomputations++;
+            totals.cpuSeconds += used;
+            if (config.cpuBudget > 0.0 && config.cpuBudget < 1.0) {
+                auto pause = std::chrono::duration<double>(used * (1.0 - config.cpuBudget) / config.cpuBudget);
+                // Not on `wake`: a paused worker must not absorb the
+                // notification meant for an idle one
+                throttle.wait_for(lock, pause, [this]() { return stopping; });
+            }
+        }
+    }
+};
+
+// Value at quantile q (0..1) of an unsorted sample; reorders the sample
+template <typename T>
+inline T quantileOf(std::vector<T>& values, double q) {
+    if (values.empty()) {
+        return T();
+    }
+    size_t rank = std::min(values.size() - 1, static_cast<size_t>(q * static_cast<double>(values.size())));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+// Capacity-planning statistics of a graph, see profileGraph
+struct GraphProfile {
+    struct Distribution {
+        double mean = 0.0;
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+        uint64_t max = 0;
+    };
+
+    struct BackendMemory {
+        const char* name;
+        uint64_t residentBytes;
+        uint64_t diskBytes;
+    };
+
+    uint64_t users = 0;
+    uint64_t connections = 0;               // undirected
+    uint64_t isolatedUsers = 0;
+    Distribution degree;
+    std::vector<uint64_t> degreeHistogram;  // bucket b counts degrees in [2^b - 1, 2^(b+1) - 1)
+
+    uint64_t components = 0;
+    uint64_t largestComponent = 0;
+    std::vector<uint64_t> componentHistogram;  // bucket b counts components of size [2^b, 2^(b+1))
+
+    // Friend-of-friend entries a common-friends query scans, per user
+    Distribution wedges;
+    // Distinct users within two hops (friends excluded), measured on a sample
+    size_t reachSamples = 0;
+    double sampledMeanReach = 0.0;
+    double reachPerWedge = 0.0;             // distinct reach over scanned entries in the sample
+
+    // Projected cost of a recommendByCommonFriends query on each layout
+    double csrBytesPerQuery = 0.0;
+    double hashBytesPerQuery = 0.0;
+
+    size_t numaNodes = 1;
+    std::vector<BackendMemory> memory;
+
+    void writeJson(std::ostream& out) const {
+        auto distribution = [&out](const Distribution& d) {
+            out << "{\"mean\": " << d.mean << ", \"p50\": " << d.p50 << ", \"p90\": " << d.p90
+                << ", \"p99\": " << d.p99 << ", \"p999\": " << d.p999 << ", \"max\": " << d.max << "}";
+        };
+        auto list = [&out](const std::vector<uint64_t>& values) {
+            out << "[";
+            for (size_t i = 0; i < values.size(); i++) {
+                out << (i ? ", " : "") << values[i];
+            }
+            out << "]";
+        };
+
+        out << "{\n  \"users\": " << users << ",\n  \"connections\": " << connections
+            << ",\n  \"isolatedUsers\": " << isolatedUsers << ",\n  \"degree\": ";
+        distribution(degree);
+        out << ",\n  \"degreeHistogramLog2\": ";
+        list(degreeHistogram);
+        out << ",\n  \"components\": {\"count\": " << components << ", \"largest\": " << largestComponent
+            << ", \"sizeHistogramLog2\": ";
+        list(componentHistogram);
+        out << "},\n  \"twoHop\": {\"wedges\": ";
+        distribution(wedges);
+        out << ", \"samples\": " << reachSamples << ", \"sampledMeanReach\": " << sampledMeanReach
+            << ", \"reachPerWedge\": " << reachPerWedge
+            << ", \"estimatedMeanReach\": " << reachPerWedge * wedges.mean << "},\n"
+            << "  \"queryCost\": {\"commonFriendsEntriesScanned\": " << wedges.mean
+            << ", \"csrBytesTouched\": " << csrBytesPerQuery
+            << ", \"hashBytesTouched\": " << hashBytesPerQuery << "},\n"
+            << "  \"memory\": {";
+        for (size_t i = 0; i < memory.size(); i++) {
+            out << (i ? "," : "") << "\n    \"" << memory[i].name << "\": {\"residentBytes\": "
+                << memory[i].residentBytes << ", \"diskBytes\": " << memory[i].diskBytes << "}";
+        }
+        out << "\n  },\n  \"numaNodes\": " << numaNodes << "\n}\n";
+    }
+};
+
+// Profile a graph for deployment sizing. One parallel pass over the rows
+// gives degrees and the wedge count of every user (the entries a
+// common-friends query scans); connected components run on the vertex-centric
+// framework; exact 2-hop reach is measured on `samples` evenly spaced users.
+// Memory is predicted per storage backend from the same counts, modelling
+// node-based containers with glibc's allocation granularity, so the figures
+// are estimates for this toolchain rather than measurements.
+inline GraphProfile profileGraph(const GraphSnapshot& graph, size_t samples = 1000, size_t numaNodes = 1) {
+    GraphProfile profile;
+    size_t n = graph.vertexCount();
+    profile.users = n;
+    profile.connections = graph.edgeCount() / 2;
+    profile.numaNodes = std::max<size_t>(1, numaNodes);
+
+    std::vector<uint64_t> degrees(n);
+    std::vector<uint64_t> wedges(n);
+    ThreadPool& pool = ThreadPool::shared();
+    pool.parallelFor(0, n, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++) {
+            uint64_t scanned = 0;
+            for (const int* it = graph.begin(static_cast<int>(v)); it != graph.end(static_cast<int>(v)); ++it) {
+                scanned += graph.degree(*it);
+            }
+            degrees[v] = graph.degree(static_cast<int>(v));
+            wedges[v] = scanned;
+        }
+    });
+
+    // Bucket counts a std::unordered_set reaches after d inserts, per distinct degree
+    std::map<uint64_t, size_t> bucketsByDegree;
+    auto summarize = [n](std::vector<uint64_t>& values, GraphProfile::Distribution& out) {
+        if (n == 0) {
+            return;
+        }
+        uint64_t sum = 0;
+        for (uint64_t value : values) {
+            sum += value;
+            out.max = std::max(out.max, value);
+        }
+        out.mean = static_cast<double>(sum) / static_cast<double>(n);
+        out.p50 = quantileOf(values, 0.5);
+        out.p90 = quantileOf(values, 0.9);
+        out.p99 = quantileOf(values, 0.99);
+        out.p999 = quantileOf(values, 0.999);
+    };
+    auto log2Bucket = [](uint64_t value) {
+        size_t bucket = 0;
+        while (value >>= 1) {
+            bucket++;
+        }
+        return bucket;
+    };
+    for (uint64_t d : degrees) {
+        profile.isolatedUsers += d == 0;
+        size_t bucket = log2Bucket(d + 1);
+        if (profile.degreeHistogram.size() <= bucket) {
+            profile.degreeHistogram.resize(bucket + 1, 0);
+        }
+        profile.degreeHistogram[bucket]++;
+        bucketsByDegree[d] = 0;
+    }
+    {
+        std::unordered_set<int> probe;
+        int inserted = 0;
+        for (auto& entry : bucketsByDegree) {
+            while (static_cast<uint64_t>(inserted) < entry.first) {
+                probe.insert(inserted++);
+            }
+            entry.second = entry.first == 0 ? 0 : probe.bucket_count();
+        }
+    }
+
+    // Memory of the node-based layouts depends on every row's bucket array
+    uint64_t hashSetBytes = 0;
+    uint64_t persistentRowBytes = 0;
+    for (uint64_t d : degrees) {
+        hashSetBytes += d * mallocChunkBytes(sizeof(void*) + sizeof(int));
+        if (d > 0) {
+            hashSetBytes += mallocChunkBytes(bucketsByDegree[d] * sizeof(void*));
+            // Rows grow one insert at a time, so capacity doubles past d
+            uint64_t capacity = 1;
+            while (capacity < d) {
+                capacity *= 2;
+            }
+            persistentRowBytes += mallocChunkBytes(capacity * sizeof(int));
+        }
+        // make_shared<Row>: control block and vector header in one chunk
+        persistentRowBytes += mallocChunkBytes(2 * sizeof(void*) + sizeof(std::vector<int>));
+    }
+    summarize(degrees, profile.degree);
+
+    std::vector<int32_t> labels = connectedComponents(graph);
+    std::vector<uint64_t> componentSize(n, 0);
+    for (int32_t label : labels) {
+        componentSize[label]++;
+    }
+    for (uint64_t size : componentSize) {
+        if (size == 0) {
+            continue;
+        }
+        profile.components++;
+        profile.largestComponent = std::max(profile.largestComponent, size);
+        size_t bucket = log2Bucket(size);
+        if (profile.componentHistogram.size() <= bucket) {
+            profile.componentHistogram.resize(bucket + 1, 0);
+        }
+        profile.componentHistogram[bucket]++;
+    }
+
+    // Exact distinct 2-hop reach of evenly spaced sample users
+    profile.reachSamples = std::min(samples, n);
+    std::vector<uint64_t> reach(profile.reachSamples, 0);
+    std::vector<uint64_t> sampledWedges(profile.reachSamples, 0);
+    size_t perChunk = std::max<size_t>(1, (profile.reachSamples + pool.size() - 1) / pool.size());
+    pool.parallelFor(0, profile.reachSamples, [&](size_t begin, size_t end) {
+        std::vector<uint32_t> seenBy(n, 0);
+        for (size_t s = begin; s < end; s++) {
+            int source = static_cast<int>(s * n / profile.reachSamples);
+            uint32_t stamp = static_cast<uint32_t>(s + 1);
+            seenBy[source] = stamp;
+            for (const int* f = graph.begin(source); f != graph.end(source); ++f) {
+                seenBy[*f] = stamp;
+            }
+            for (const int* f = graph.begin(source); f != graph.end(source); ++f) {
+                for (const int* c = graph.begin(*f); c != graph.end(*f); ++c) {
+                    if (seenBy[*c] != stamp) {
+                        seenBy[*c] = stamp;
+                        reach[s]++;
+                    }
+                }
+            }
+            sampledWedges[s] = wedges[source];
+        }
+    }, perChunk);
+    uint64_t reachTotal = 0;
+    uint64_t sampledWedgeTotal = 0;
+    for (size_t s = 0; s < profile.reachSamples; s++) {
+        reachTotal += reach[s];
+        sampledWedgeTotal += sampledWedges[s];
+    }
+    if (profile.reachSamples > 0) {
+        profile.sampledMeanReach = static_cast<double>(reachTotal) / static_cast<double>(profile.reachSamples);
+    }
+    if (sampledWedgeTotal > 0) {
+        profile.reachPerWedge = static_cast<double>(reachTotal) / static_cast<double>(sampledWedgeTotal);
+    }
+    summarize(wedges, profile.wedges);
+
+    // A CSR query reads each friend's offsets and contiguous row; the hash
+    // layout takes a cache miss per set node and per bucket array
+    const double cacheLine = 64.0;
+    profile.csrBytesPerQuery = profile.wedges.mean * sizeof(int) + profile.degree.mean * (sizeof(int) + cacheLine);
+    profile.hashBytesPerQuery = profile.wedges.mean * cacheLine + profile.degree.mean * 2 * cacheLine;
+
+    uint64_t entries = graph.edgeCount();
+    uint64_t idIndexBytes = n * (mallocChunkBytes(sizeof(void*) + 2 * sizeof(int)) + sizeof(void*));
+    uint64_t csrBytes = n * sizeof(int) + (n + 1) * sizeof(size_t) + entries * sizeof(int) + idIndexBytes;
+    uint64_t hashBytes = n * (mallocChunkBytes(sizeof(void*) + sizeof(AdjacencyMap::value_type)) +
+                              sizeof(void*)) + hashSetBytes;
+    uint64_t persistentBytes = PersistentGraph::trieNodeCount(graph.ids) *
+                               mallocChunkBytes(2 * sizeof(void*) + PersistentGraph::nodeBytes()) + persistentRowBytes;
+    uint64_t semiExternalResident = n * sizeof(int) + (n + 1) * sizeof(uint64_t) + idIndexBytes;
+    uint64_t numaBytes = csrBytes + (profile.numaNodes - 1) * sizeof(size_t);
+    profile.memory = {
+        {"hash", hashBytes, 0},
+        {"csr", csrBytes, 0},
+        {"delta", csrBytes, 0},             // at rest; pending edits add about 8 bytes each
+        {"persistent", persistentBytes, 0},
+        {"semiExternal", semiExternalResident, SemiExternalGraph::fileBytes(n, entries)},
+        {"numa", numaBytes, 0},
+    };
+    return profile;
+}
+
+// One edit of a mutation batch
+struct Mutation {
+    enum Type : uint8_t { AddConnection, RemoveConnection };
+
+    Type type;
+    int userId1;
+    int userId2;
+};
+
+// Number of friendships a batch actually created or removed
+struct BatchResult {
+    size_t connectionsAdded = 0;
+    size_t connectionsRemoved = 0;
+};
+
+class SocialNetwork {
+private:
+    // Adjacency list representation of the social graph
+    AdjacencyMap graph;
+
+    // Bumped on every mutation so derived structures can detect staleness
+    uint64_t version = 0;
+
+    // CSR copy of the graph used by the analytics passes
+    std::shared_ptr<const GraphSnapshot> snapshot;
+    uint64_t snapshotVersion = std::numeric_limits<uint64_t>::max();
+
+    // Node embeddings, stored inside the ANN index built over them
+    std::shared_ptr<const GraphSnapshot> embeddingSnapshot;
+    HnswIndex embeddingIndex;
+
+    // Community ids from the last detectCommunities() run
+    CommunityAssignment communities;
+
+    // Edge embeddedness and clustering from the last computeTieStrength() run
+    TriangleIndex triangles;
+
+    // Core numbers from the last computeCoreNumbers() run
+    CoreIndex cores;
+    ComponentIndex components;
+    PageRankIndex pageRanks;
+
+    // Popular users served to users with few friends, see enableColdStart()
+    ColdStartConfig coldStartConfig;
+    ColdStartLists coldStart;
+
+    // Subscribers of the recommendation change feed; expired ones are pruned
+    std::vector<std::weak_ptr<ChangeFeed>> changeFeeds;
+
+    // Per-user attributes used by attribute-constrained queries
+    AttributeStore attributes;
+
+    // Users each user must never be recommended again
+    CountedMap<int, ExclusionList, MemoryCategory::Indexes> exclusions;
+
+    // Copy-on-write mirror of the graph and the versions retained from it
+    std::unique_ptr<PersistentGraph> history;
+    std::map<uint64_t, PersistentGraph::Version> retainedVersions;
+
+    // Background precompute: mutations hold stateMutex exclusively, workers
+    // shared while they read. Nested mutation calls lock only once.
+    std::shared_mutex stateMutex;
+    int mutationDepth = 0;
+    PrecomputedStore precomputed;
+    size_t precomputeK = 10;
+    // Declared last so its workers stop before the state they read is destroyed
+    std::unique_ptr<PrecomputeScheduler> scheduler;
+
+    struct MutationGuard {
+        SocialNetwork& network;
+
+        explicit MutationGuard(SocialNetwork& owner) : network(owner) {
+            if (network.mutationDepth++ == 0) {
+                network.stateMutex.lock();
+            }
+        }
+
+        ~MutationGuard() {
+            if (--network.mutationDepth == 0) {
+                network.stateMutex.unlock();
+            }
+        }
+    };
+
+    // Candidate ranked by a key that may differ from the value reported to the caller
+    struct ScoredCandidate {
+        int userId;
+        int value;
+        double rank;
+    };
+
+    static std::vector<std::pair<int, int>> rankCandidates(std::vector<ScoredCandidate>& candidates,
+                                                           bool descending) {
+        std::sort(candidates.begin(), candidates.end(),
+            [descending](const ScoredCandidate& a, const ScoredCandidate& b) {
+                return descending ? a.rank > b.rank : a.rank < b.rank;
+            });
+        std::vector<std::pair<int, int>> recommendations;
+        recommendations.reserve(candidates.size());
+        for (const auto& candidate : candidates) {
+            recommendations.push_back({candidate.userId, candidate.value});
+        }
+        return recommendations;
+    }
+
+    bool sameCommunity(int userId1, int userId2) const {
+        int32_t community = communities.communityOf(userId1);
+        return community >= 0 && community == communities.communityOf(userId2);
+    }
+
+    // Per-query state of the candidate filters, prepared before the candidate loop
+    struct CandidateFilter {
+        const QueryOptions& options;
+        int32_t community;                  // the user's community, -1 if unknown
+        bool attributesFiltered;
+        Bitmap allowedRows;                 // attribute-store rows matching every predicate
+        const ExclusionList* excluded;      // users this user blocked or dismissed
+    };
+
+    CandidateFilter prepareFilter(int userId, const QueryOptions& options) const {
+        auto exclusionIt = exclusions.find(userId);
+        CandidateFilter filter{options, communities.communityOf(userId), !options.attributeFilters.empty(), Bitmap(),
+                               exclusionIt == exclusions.end() ? nullptr : &exclusionIt->second};
+        if (filter.attributesFiltered) {
+            filter.allowedRows = attributes.evaluate(options.attributeFilters);
+        }
+        return filter;
+    }
+
+    // Filters applied inside the candidate loops of every recommender
+    bool admitCandidate(const CandidateFilter& filter, int candidate) const {
+        const QueryOptions& options = filter.options;
+        if (filter.excluded && filter.excluded->contains(candidate)) {
+            return false;
+        }
+        if (options.sameCommunityOnly && filter.community >= 0 &&
+            communities.communityOf(candidate) != filter.community) {
+            return false;
+        }
+        if (filter.attributesFiltered) {
+            long long row = attributes.rowOf(candidate);
+            if (row < 0 || !filter.allowedRows.test(static_cast<size_t>(row))) {
+                return false;
+            }
+        }
+        if (options.minCandidateCore > 0) {
+            int32_t core = cores.coreOf(candidate);
+            if (core >= 0 && core < options.minCandidateCore) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Whether the neighbours of an intermediate user are explored
+    bool expandThrough(int intermediate, const QueryOptions& options) const {
+        if (options.maxIntermediateCore > 0) {
+            int32_t core = cores.coreOf(intermediate);
+            if (core > options.maxIntermediateCore) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Multiplier applied to the ranking key of a candidate
+    double rankBoost(int userId, int candidate, const QueryOptions& options) const {
+        double boost = 1.0;
+        if (options.sameCommunityBoost != 0.0 && sameCommunity(userId, candidate)) {
+            boost += options.sameCommunityBoost;
+        }
+        if (options.pageRankWeight != 0.0 && !pageRanks.empty() && pageRanks.maxRank > 0.0f) {
+            boost += options.pageRankWeight * pageRanks.rankOf(candidate) / pageRanks.maxRank;
+        }
+        return boost;
+    }
+
+    // Weight of a common friend when ranking by tie strength
+    double commonFriendWeight(int userId, int commonFriend, const QueryOptions& options) const {
+        if (options.tieStrengthWeight == 0.0) {
+            return 1.0;
+        }
+        return 1.0 + options.tieStrengthWeight * triangles.overlap(userId, commonFriend);
+    }
+
+    // Rank the monitored keys of a Space-Saving sketch and report their error bounds
+    std::vector<std::pair<int, int>> rankSketch(int userId, const SpaceSavingSketch& sketch,
+                                                const QueryOptions& options, QueryStats& work) const {
+        std::vector<ScoredCandidate> candidates;
+        std::unordered_map<int, int> errorOf;
+        candidates.reserve(sketch.size());
+        errorOf.reserve(sketch.size());
+        for (size_t counter = 0; counter < sketch.size(); counter++) {
+            int candidate = sketch.key(counter);
+            candidates.push_back({candidate, static_cast<int>(std::lround(sketch.count(counter))),
+                                  sketch.count(counter) * rankBoost(userId, candidate, options)});
+            errorOf[candidate] = static_cast<int>(std::ceil(sketch.error(counter)));
+        }
+
+        auto recommendations = rankCandidates(candidates, true);
+        work.countErrors.clear();
+        work.countErrors.reserve(recommendations.size());
+        for (const auto& recommendation : recommendations) {
+            work.countErrors.push_back(errorOf[recommendation.first]);
+        }
+        work.maxCountError = static_cast<int>(std::ceil(sketch.minCount()));
+        return recommendations;
+    }
+
+    // Uniform sample of sampleSize entries of a CSR row, by Floyd's
+    // algorithm in O(sampleSize)
+    std::vector<int> sampleNeighbors(int vertex, size_t sampleSize, std::mt19937_64& rng) const {
+        std::vector<int> sample;
+        sample.reserve(sampleSize);
+        size_t degree = snapshot->degree(vertex);
+        const int* row = snapshot->begin(vertex);
+        std::unordered_set<size_t> chosen;
+        chosen.reserve(sampleSize * 2);
+        for (size_t j = degree - sampleSize; j < degree; j++) {
+            size_t pick = std::uniform_int_distribution<size_t>(0, j)(rng);
+            if (!chosen.insert(pick).second) {
+                chosen.insert(j);
+                pick = j;
+            }
+            sample.push_back(snapshot->ids[row[pick]]);
+        }
+        return sample;
+    }
+
+    // An exclusion of userId changed, which only affects their own list.
+    // The stored list may show a now-blocked user, so it is dropped rather
+    // than served stale until the worker gets to it.
+    void exclusionChanged(int userId) {
+        if (scheduler) {
+            precomputed.erase(userId);
+            scheduler->markStale(userId);
+        }
+    }
+
+    // Keeps derived state in step with every connection that actually changed
+    void connectionChanged(int userId1, int userId2, bool added) {
+        // Keep detected communities current without a full re-run
+        if (added && !communities.empty()) {
+            updateCommunity(userId1);
+            updateCommunity(userId2);
+        }
+        if (history) {
+            if (added) {
+                history->addConnection(userId1, userId2);
+            } else {
+                history->removeConnection(userId1, userId2);
+            }
+        }
+        if (scheduler) {
+            // The endpoints and their friends are the users whose lists can change
+            for (int endpoint : {userId1, userId2}) {
+                scheduler->markStale(endpoint);
+                for (int friendId : graph.at(endpoint)) {
+                    scheduler->markStale(friendId);
+                }
+            }
+        }
+        if (coldStart.enabled && coldStartConfig.refreshEvery > 0 &&
+            version - coldStart.builtAtVersion >= coldStartConfig.refreshEvery) {
+            refreshColdStart();
+        }
+    }
+
+    // Top-K lists of every user a set of edge changes can affect, taken
+    // before the change: the endpoints and their friends, the only users
+    // whose common-friend counts with anyone can move
+    struct FeedCapture {
+        std::vector<int> users;
+        std::vector<std::shared_ptr<ChangeFeed>> feeds;
+        std::map<size_t, std::vector<std::vector<std::pair<int, int>>>> before;    // k -> list per user
+    };
+
+    FeedCapture captureFeeds(const std::vector<std::pair<int, int>>& edges) {
+        std::vector<int> users;
+        if (!changeFeeds.empty()) {
+            for (const auto& edge : edges) {
+                for (int endpoint : {edge.first, edge.second}) {
+                    users.push_back(endpoint);
+                    auto it = graph.find(endpoint);
+                    if (it != graph.end()) {
+                        users.insert(users.end(), it->second.begin(), it->second.end());
+                    }
+                }
+            }
+        }
+        return captureFeedsOfUsers(std::move(users));
+    }
+
+    // Top-K lists of the given users, before a change that only they see
+    FeedCapture captureFeedsOfUsers(std::vector<int> users) {
+        FeedCapture capture;
+        if (!liveFeeds(capture.feeds)) {
+            return capture;
+        }
+        std::sort(users.begin(), users.end());
+        users.erase(std::unique(users.begin(), users.end()), users.end());
+        capture.users = std::move(users);
+        for (const auto& feed : capture.feeds) {
+            auto& lists = capture.before[feed->listSize()];
+            if (lists.empty()) {
+                for (int userId : capture.users) {
+                    lists.push_back(recommendTopKByCommonFriends(userId, feed->listSize()));
+                }
+            }
+        }
+        return capture;
+    }
+
+    // Collect the subscribed feeds and forget released ones
+    bool liveFeeds(std::vector<std::shared_ptr<ChangeFeed>>& feeds) {
+        size_t live = 0;
+        for (const auto& weak : changeFeeds) {
+            if (auto feed = weak.lock()) {
+                feeds.push_back(feed);
+                changeFeeds[live++] = weak;
+            }
+        }
+        changeFeeds.resize(live);
+        return !feeds.empty();
+    }
+
+    // Tell every subscriber that all lists may have changed at once
+    void publishResync() {
+        std::vector<std::shared_ptr<ChangeFeed>> feeds;
+        liveFeeds(feeds);
+        for (const auto& feed : feeds) {
+            RecommendationDelta delta;
+            delta.resync = true;
+            delta.version = version;
+            feed->publish(std::move(delta));
+        }
+    }
+
+    // Recompute the captured lists and publish the ones that changed
+    void publishFeeds(const FeedCapture& capture) const {
+        for (const auto& entry : capture.before) {
+            size_t k = entry.first;
+            for (size_t i = 0; i < capture.users.size(); i++) {
+                int userId = capture.users[i];
+                std::vector<std::pair<int, int>> after = recommendTopKByCommonFriends(userId, k);
+                std::unordered_map<int, int> previous(entry.second[i].begin(), entry.second[i].end());
+
+                RecommendationDelta delta;
+                delta.userId = userId;
+                delta.version = version;
+                for (const auto& recommendation : after) {
+                    auto it = previous.find(recommendation.first);
+                    if (it == previous.end() || it->second != recommendation.second) {
+                        delta.upserted.push_back(recommendation);
+                    }
+                    if (it != previous.end()) {
+                        previous.erase(it);
+                    }
+                }
+                for (const auto& left : previous) {
+                    delta.removed.push_back(left.first);
+                }
+                if (delta.upserted.empty() && delta.removed.empty()) {
+                    continue;
+                }
+                std::sort(delta.removed.begin(), delta.removed.end());
+                for (const auto& feed : capture.feeds) {
+                    if (feed->listSize() == k) {
+                        feed->publish(delta);
+                    }
+                }
+            }
+        }
+    }
+
+    // Append cold-start users to the results of a user with fewer than
+    // degreeThreshold friends, up to blendCount users and a total of limit
+    // results. Walks only the precomputed lists; users already recommended
+    // are skipped. Appended users carry the value 0.
+    void blendColdStart(int userId, const CandidateFilter& filter, std::vector<std::pair<int, int>>& recommendations,
+                        size_t limit = std::numeric_limits<size_t>::max()) const {
+        if (!coldStart.enabled || coldStartConfig.blendCount == 0) {
+            return;
+        }
+        auto userIt = graph.find(userId);
+        if (userIt != graph.end() && userIt->second.size() >= coldStartConfig.degreeThreshold) {
+            return;
+        }
+
+        std::unordered_set<int> present;
+        for (const auto& recommendation : recommendations) {
+            present.insert(recommendation.first);
+        }
+        size_t added = 0;
+        auto take = [&](const ColdStartLists::List& list) {
+            for (const auto& entry : list) {
+                if (added == coldStartConfig.blendCount || recommendations.size() >= limit) {
+                    return;
+                }
+                int candidate = entry.first;
+                if (candidate == userId || (userIt != graph.end() && userIt->second.count(candidate)) ||
+                    !admitCandidate(filter, candidate) || !present.insert(candidate).second) {
+                    continue;
+                }
+                recommendations.push_back({candidate, 0});
+                added++;
+            }
+        };
+        if (!coldStartConfig.bucketAttribute.empty()) {
+            auto bucket = coldStart.buckets.find(attributes.get(userId, coldStartConfig.bucketAttribute));
+            if (bucket != coldStart.buckets.end()) {
+                take(bucket->second);
+            }
+        }
+        take(coldStart.global);
+    }
+
+    // Give a new or re-wired endpoint the majority community of its neighbours
+    void updateCommunity(int userId) {
+        auto slot = communities.slotOf.find(userId);
+        std::unordered_map<int32_t, int> votes;
+        for (int friendId : graph.at(userId)) {
+            int32_t community = communities.communityOf(friendId);
+            if (community >= 0) {
+                votes[community]++;
+            }
+        }
+
+        int32_t current = slot == communities.slotOf.end() ? -1 : communities.community[slot->second];
+        int32_t best = current;
+        int bestVotes = current >= 0 && votes.count(current) ? votes[current] : 0;
+        for (const auto& vote : votes) {
+            if (vote.second > bestVotes) {
+                best = vote.first;
+                bestVotes = vote.second;
+            }
+        }
+        if (best < 0) {
+            best = communities.communityCount++;
+        }
+
+        if (slot == communities.slotOf.end()) {
+            communities.slotOf[userId] = static_cast<int>(communities.ids.size());
+            communities.ids.push_back(userId);
+            communities.community.push_back(best);
+        } else {
+            communities.community[slot->second] = best;
+        }
+    }
+
+    // Unscoped bodies of the public lookups below. Queries call these so the
+    // API metrics count each public call once, not every inner-loop lookup.
+    const FriendSet& friendsOf(int userId) const {
+        static const FriendSet none;
+        auto it = graph.find(userId);
+        return it != graph.end() ? it->second : none;
+    }
+
+    int networkDistance(int userId1, int userId2) const {
+        CountedSet<int, MemoryCategory::Workspaces> visited;
+        std::queue<std::pair<int, int>> queue;
+
+        queue.push({userId1, 0});
+        visited.insert(userId1);
+
+        while (!queue.empty()) {
+            int currentUser = queue.front().first;
+            int distance = queue.front().second;
+            queue.pop();
+
+            if (currentUser == userId2) {
+                return distance;
+            }
+
+            for (int neighbor : friendsOf(currentUser)) {
+                if (visited.count(neighbor) == 0) {
+                    visited.insert(neighbor);
+                    queue.push({neighbor, distance + 1});
+                }
+            }
+        }
+
+        // No path found
+        return std::numeric_limits<int>::max();
+    }
+
+    bool excluded(int userId, int candidateId) const {
+        auto it = exclusions.find(userId);
+        return it != exclusions.end() && it->second.contains(candidateId);
+    }
+
+    std::shared_ptr<const GraphSnapshot> refreshSnapshot() {
+        if (snapshotVersion != version) {
+            snapshot = std::make_shared<const GraphSnapshot>(buildSnapshot());
+            snapshotVersion = version;
+        }
+        return snapshot;
+    }
+
+public:
+    
+    void addUser(int userId) {
+        SM_METRIC_SCOPE("addUser");
+        MutationGuard guard(*this);
+        if (graph.find(userId) == graph.end()) {
+            graph[userId] = FriendSet();
+            version++;
+            if (history) {
+                history->addUser(userId);
+            }
+        }
+    }
+
+    // Add a connection between two users
+    void addConnection(int userId1, int userId2) {
+        SM_METRIC_SCOPE("addConnection");
+        MutationGuard guard(*this);
+        // Lists are only captured when the edge is new
+        auto existing = graph.find(userId1);
+        FeedCapture capture;
+        if (existing == graph.end() || !existing->second.count(userId2)) {
+            capture = captureFeeds({{userId1, userId2}});
+        }
+
+        // Ensure both users exist
+        addUser(userId1);
+        addUser(userId2);
+
+        // Add bidirectional connection
+        bool added = graph[userId1].insert(userId2).second;
+        graph[userId2].insert(userId1);
+        version++;
+
+        if (added) {
+            connectionChanged(userId1, userId2, true);
+            publishFeeds(capture);
+        }
+    }
+
+    // Remove connection
+    void removeConnection(int userId1, int userId2) {
+        SM_METRIC_SCOPE("removeConnection");
+        MutationGuard guard(*this);
+        if (graph.find(userId1) != graph.end() && 
+            graph.find(userId2) != graph.end()) {
+            FeedCapture capture;
+            if (graph.at(userId1).count(userId2)) {
+                capture = captureFeeds({{userId1, userId2}});
+            }
+            bool removed = graph[userId1].erase(userId2) > 0;
+            graph[userId2].erase(userId1);
+            version++;
+
+            if (removed) {
+                connectionChanged(userId1, userId2, false);
+                publishFeeds(capture);
+            }
+        }
+    }
+
+    // Apply a batch of mutations with the same end state as calling
+    // addConnection/removeConnection in order. Edits are expanded to both
+    // directions, sorted by (source, target, position) so that only the
+    // last edit of every edge survives, and each source's adjacency is then
+    // updated in one pass; sources are disjoint, so they run in parallel.
+    BatchResult applyBatch(const Mutation* mutations, size_t count) {
+        SM_METRIC_SCOPE("applyBatch");
+        MutationGuard guard(*this);
+        struct Edit {
+            int source;
+            int target;
+            size_t position;
+            Mutation::Type type;
+        };
+
+        std::vector<std::pair<int, int>> touched;
+        if (!changeFeeds.empty()) {
+            for (size_t i = 0; i < count; i++) {
+                touched.push_back({mutations[i].userId1, mutations[i].userId2});
+            }
+        }
+        FeedCapture capture = captureFeeds(touched);
+
+        std::vector<Edit> edits;
+        edits.reserve(count * 2);
+        for (size_t i = 0; i < count; i++) {
+            const Mutation& mutation = mutations[i];
+            edits.push_back({mutation.userId1, mutation.userId2, i, mutation.type});
+            if (mutation.userId1 != mutation.userId2) {
+                edits.push_back({mutation.userId2, mutation.userId1, i, mutation.type});
+            }
+            // Adding creates both users even if a later edit removes the edge
+            if (mutation.type == Mutation::AddConnection) {
+                addUser(mutation.userId1);
+                addUser(mutation.userId2);
+            }
+        }
+        std::sort(edits.begin(), edits.end(), [](const Edit& a, const Edit& b) {
+            if (a.source != b.source) {
+                return a.source < b.source;
+            }
+            return a.target != b.target ? a.target < b.target : a.position < b.position;
+        });
+
+        // Keep the last edit per edge; record where every source's edits start
+        size_t kept = 0;
+        std::vector<size_t> groupStarts;
+        for (size_t i = 0; i < edits.size(); i++) {
+            if (i + 1 < edits.size() && edits[i + 1].source == edits[i].source &&
+                edits[i + 1].target == edits[i].target) {
+                continue;
+            }
+            if (kept == 0 || edits[kept - 1].source != edits[i].source) {
+                groupStarts.push_back(kept);
+            }
+            edits[kept++] = edits[i];
+        }
+        edits.resize(kept);
+        groupStarts.push_back(kept);
+
+        std::atomic<size_t> inserted(0);
+        std::atomic<size_t> erased(0);
+        std::vector<uint8_t> changedEdits(edits.size(), 0);
+        parallelFor(0, groupStarts.size() - 1, [&](size_t begin, size_t end) {
+            size_t localInserted = 0;
+            size_t localErased = 0;
+            for (size_t group = begin; group < end; group++) {
+                auto it = graph.find(edits[groupStarts[group]].source);
+                if (it == graph.end()) {
+                    continue;   // only removals for a user that does not exist
+                }
+                FriendSet& friendSet = it->second;
+                friendSet.reserve(friendSet.size() + (groupStarts[group + 1] - groupStarts[group]));
+                for (size_t e = groupStarts[group]; e < groupStarts[group + 1]; e++) {
+                    // Each connection is counted from its smaller endpoint only
+                    bool counted = edits[e].source <= edits[e].target;
+                    bool changed;
+                    if (edits[e].type == Mutation::AddConnection) {
+                        changed = friendSet.insert(edits[e].target).second;
+                        localInserted += counted && changed;
+                    } else {
+                        changed = friendSet.erase(edits[e].target) > 0;
+                        localErased += counted && changed;
+                    }
+                    changedEdits[e] = counted && changed;
+                }
+            }
+            inserted += localInserted;
+            erased += localErased;
+        });
+
+        BatchResult result;
+        result.connectionsAdded = inserted.load();
+        result.connectionsRemoved = erased.load();
+        if (result.connectionsAdded + result.connectionsRemoved > 0) {
+            version++;
+        }
+
+        for (size_t e = 0; e < edits.size(); e++) {
+            if (changedEdits[e]) {
+                connectionChanged(edits[e].source, edits[e].target, edits[e].type == Mutation::AddConnection);
+            }
+        }
+        if (result.connectionsAdded + result.connectionsRemoved > 0) {
+            publishFeeds(capture);
+        }
+        return result;
+    }
+
+    BatchResult applyBatch(const std::vector<Mutation>& mutations) {
+        return applyBatch(mutations.data(), mutations.size());
+    }
+
+    // Get direct friends of a user
+    std::unordered_set<int> getFriends(int userId) const {
+        SM_METRIC_SCOPE("getFriends");
+        const FriendSet& friends = friendsOf(userId);
+        return std::unordered_set<int>(friends.begin(), friends.end());
+    }
+
+    // Method 1: Recommend friends based on common friends
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) const {
+        return recommendByCommonFriends(userId, QueryOptions());
+    }
+
+    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId, const QueryOptions& options,
+                                                              QueryStats* stats = nullptr) const {
+        SM_METRIC_SCOPE("recommendByCommonFriends");
+        // Map to store potential friends and their common friend count.
+        // Counts are estimates once a supernode has been sampled.
+        CountedMap<int, double, MemoryCategory::Workspaces> potentialFriends;
+        CountedMap<int, double, MemoryCategory::Workspaces> weightedCounts;
+        std::unique_ptr<SpaceSavingSketch> sketch;
+        if (options.approximateCounters > 0) {
+            sketch.reset(new SpaceSavingSketch(options.approximateCounters));
+        }
+        QueryStats localStats;
+        QueryStats& work = stats ? *stats : localStats;
+        CandidateFilter filter = prepareFilter(userId, options);
+        std::mt19937_64 rng(options.samplingSeed ^ mixBits(static_cast<uint64_t>(userId)));
+
+        // Get user's existing friends
+        const FriendSet& userFriends = friendsOf(userId);
+
+        // Find friends of friends
+        for (int currentFriend : userFriends) {
+            if (!expandThrough(currentFriend, options)) {
+                continue;
+            }
+            double weight = commonFriendWeight(userId, currentFriend, options);
+            const FriendSet& friendsOfFriend = graph.at(currentFriend);
+
+            auto visit = [&](int friendOfFriend, double scale) {
+                work.edgesScanned++;
+                // Skip if already a friend or the user itself
+                if (friendOfFriend == userId || userFriends.count(friendOfFriend) ||
+                    !admitCandidate(filter, friendOfFriend)) {
+                    return;
+                }
+
+                // Increment common friends count
+                work.counterUpdates++;
+                if (sketch) {
+                    sketch->add(friendOfFriend, scale);
+                    return;
+                }
+                potentialFriends[friendOfFriend] += scale;
+                if (options.tieStrengthWeight != 0.0) {
+                    weightedCounts[friendOfFriend] += weight * scale;
+                }
+            };
+
+            size_t degree = friendsOfFriend.size();
+            if (options.supernodeDegree == 0 || degree <= options.supernodeDegree) {
+                work.intermediatesExpanded++;
+                for (int friendOfFriend : friendsOfFriend) {
+                    visit(friendOfFriend, 1.0);
+                }
+            } else {
+                // Sampling needs a current CSR row: drawing from the live
+                // hash set would read all of it, so the supernode is skipped
+                int vertex = -1;
+                if (options.supernodePolicy == SupernodePolicy::Sample && options.supernodeSampleSize > 0 &&
+                    snapshot && snapshotVersion == version) {
+                    vertex = snapshot->vertexOf(currentFriend);
+                }
+                if (vertex < 0) {
+                    work.supernodesSkipped++;
+                    work.edgesSkipped += degree;
+                    continue;
+                }
+                work.intermediatesExpanded++;
+                work.supernodesSampled++;
+                size_t sampleSize = std::min(options.supernodeSampleSize, degree);
+                work.edgesSkipped += degree - sampleSize;
+                // Every neighbour is kept with probability sampleSize / degree
+                double scale = static_cast<double>(degree) / static_cast<double>(sampleSize);
+                for (int friendOfFriend : sampleNeighbors(vertex, sampleSize, rng)) {
+                    visit(friendOfFriend, scale);
+                }
+            }
+        }
+
+        if (sketch) {
+            std::vector<std::pair<int, int>> recommendations = rankSketch(userId, *sketch, options, work);
+            blendColdStart(userId, filter, recommendations);
+            return recommendations;
+        }
+
+        // Convert to vector for sorting
+        std::vector<ScoredCandidate> candidates;
+        candidates.reserve(potentialFriends.size());
+        for (const auto& pair : potentialFriends) {
+            double strength = options.tieStrengthWeight != 0.0 ? weightedCounts[pair.first] : pair.second;
+            candidates.push_back({pair.first, static_cast<int>(std::lround(pair.second)),
+                                  strength * rankBoost(userId, pair.first, options)});
+        }
+
+        // Sort by number of common friends in descending order
+        std::vector<std::pair<int, int>> recommendations = rankCandidates(candidates, true);
+        blendColdStart(userId, filter, recommendations);
+        return recommendations;
+    }
+
+    // Top-k users by common friends with early termination. Friends are
+    // expanded in options.expansionOrder; after each one, a candidate can
+    // still gain at most min(friends left, its degree - its count), and an
+    // unseen candidate at most the number of friends left. Once the k-th
+    // count reaches every such bound the remaining friends are only probed
+    // against the k winners to make their counts exact.
+    // Community boost, tie strength, supernode and approximate options are not applied.
+    std::vector<std::pair<int, int>> recommendTopKByCommonFriends(int userId, size_t k,
+                                                                  const QueryOptions& options = QueryOptions(),
+                                                                  QueryStats* stats = nullptr) const {
+        SM_METRIC_SCOPE("recommendTopKByCommonFriends");
+        QueryStats localStats;
+        QueryStats& work = stats ? *stats : localStats;
+        std::vector<std::pair<int, int>> recommendations;
+        auto userIt = graph.find(userId);
+        if (k == 0) {
+            return recommendations;
+        }
+        CandidateFilter filter = prepareFilter(userId, options);
+        if (userIt == graph.end()) {
+            blendColdStart(userId, filter, recommendations, k);
+            return recommendations;
+        }
+        const FriendSet& userFriends = userIt->second;
+
+        CountedVector<std::pair<size_t, int>, MemoryCategory::Workspaces> order;
+        order.reserve(userFriends.size());
+        for (int friendId : userFriends) {
+            if (expandThrough(friendId, options)) {
+                order.push_back({graph.at(friendId).size(), friendId});
+            }
+        }
+        if (options.expansionOrder == ExpansionOrder::AscendingDegree) {
+            std::sort(order.begin(), order.end());
+        } else {
+            std::sort(order.begin(), order.end(), std::greater<std::pair<size_t, int>>());
+        }
+
+        struct Tally {
+            int count = 0;
+            size_t degree = 0;              // 0 until looked up, see below
+        };
+        CountedMap<int, Tally, MemoryCategory::Workspaces> counts;
+        // Candidates in the order they were first reached; map nodes never move
+        CountedVector<std::pair<int, Tally*>, MemoryCategory::Workspaces> seen;
+        // histogram[c] = number of candidates with exactly c common friends so far
+        CountedVector<size_t, MemoryCategory::Workspaces> histogram(order.size() + 1, 0);
+        // kth = largest count reached by at least k candidates (0 while fewer
+        // are seen) and atLeastKth = candidates with count >= kth. Both only
+        // grow, so they are maintained in amortized O(1) per counter update.
+        int kth = 0;
+        size_t atLeastKth = 0;
+
+        // A candidate outside the top k can still pass the k-th count only
+        // if count + remaining > kth and its degree exceeds kth. Once checks
+        // start, candidates are resolved in the order of `seen`: the ones
+        // that can still pass get their degree looked up and, if it exceeds
+        // closedThrough, become "open". open[c] counts open candidates by
+        // current count and a min-heap on degree closes them when
+        // closedThrough catches up with kth. count + remaining never grows
+        // while kth never shrinks, so a candidate skipped by the resolver
+        // (including every one first reached after checks started) can never
+        // pass. Resolving stops while some open candidate is a threat, so
+        // each candidate is resolved at most once and usually not at all.
+        size_t resolved = 0;
+        int closedThrough = 0;
+        CountedVector<size_t, MemoryCategory::Workspaces> open(order.size() + 1, 0);
+        std::priority_queue<std::pair<size_t, int>, CountedVector<std::pair<size_t, int>, MemoryCategory::Workspaces>,
+                            std::greater<std::pair<size_t, int>>> openByDegree;
+        // Number of open candidates with a count above a bound that only rises
+        struct OpenAbove {
+            int bound = 0;
+            size_t count = 0;
+
+            void raise(int newBound, const CountedVector<size_t, MemoryCategory::Workspaces>& open) {
+                while (bound < newBound) {
+                    count -= open[++bound];
+                }
+            }
+            void moved(int from, int to) {
+                count += (to > bound) - (from > bound);
+            }
+        };
+        OpenAbove mayPass;                  // bound kth - remaining
+        OpenAbove atOrAboveKth;             // bound kth - 1
+
+        size_t processed = 0;
+        for (; processed < order.size(); processed++) {
+            int remaining = static_cast<int>(order.size() - processed);
+            if (kth >= remaining) {
+                closedThrough = kth;
+                while (!openByDegree.empty() && openByDegree.top().first <= static_cast<size_t>(closedThrough)) {
+                    int closed = counts.at(openByDegree.top().second).count;
+                    openByDegree.pop();
+                    open[closed]--;
+                    mayPass.moved(closed, 0);
+                    atOrAboveKth.moved(closed, 0);
+                }
+                mayPass.raise(kth - remaining, open);
+                atOrAboveKth.raise(kth - 1, open);
+                // Open candidates below kth that can pass it. If more than k
+                // candidates share kth, which of them win is only settled
+                // when none of them can still grow.
+                auto threats = [&]() {
+                    return mayPass.count - atOrAboveKth.count + (atLeastKth == k ? 0 : open[kth]);
+                };
+                while (threats() == 0 && resolved < seen.size()) {
+                    int candidate = seen[resolved].first;
+                    Tally& tally = *seen[resolved].second;
+                    resolved++;
+                    if (tally.count + remaining <= kth) {
+                        continue;
+                    }
+                    tally.degree = graph.at(candidate).size();
+                    if (tally.degree > static_cast<size_t>(closedThrough)) {
+                        openByDegree.push({tally.degree, candidate});
+                        open[tally.count]++;
+                        mayPass.moved(0, tally.count);
+                        atOrAboveKth.moved(0, tally.count);
+                    }
+                }
+                if (threats() == 0) {
+                    break;
+                }
+            }
+
+            int currentFriend = order[processed].second;
+            work.intermediatesExpanded++;
+            for (int friendOfFriend : graph.at(currentFriend)) {
+                work.edgesScanned++;
+                if (friendOfFriend == userId || userFriends.count(friendOfFriend) ||
+                    !admitCandidate(filter, friendOfFriend)) {
+                    continue;
+                }
+                Tally& tally = counts[friendOfFriend];
+                int before = tally.count++;
+                if (before == 0) {
+                    seen.push_back({friendOfFriend, &tally});
+                } else {
+                    histogram[before]--;
+                }
+                histogram[tally.count]++;
+                if (tally.degree > static_cast<size_t>(closedThrough)) {
+                    open[before]--;
+                    open[tally.count]++;
+                    mayPass.moved(before, tally.count);
+                    atOrAboveKth.moved(before, tally.count);
+                }
+                work.counterUpdates++;
+
+                if (kth == 0 ? before == 0 : before < kth && tally.count >= kth) {
+                    atLeastKth++;
+                }
+                // Raise kth while k candidates are strictly above it
+                while (atLeastKth - (kth > 0 ? histogram[kth] : 0) >= k) {
+                    atLeastKth -= kth > 0 ? histogram[kth] : 0;
+                    kth++;
+                }
+            }
+        }
+
+        recommendations.reserve(counts.size());
+        for (const auto& entry : counts) {
+            recommendations.push_back({entry.first, entry.second.count});
+        }
+        // Ties are broken by user id so equal graphs always give equal lists
+        auto byCount = [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        if (recommendations.size() > k) {
+            std::nth_element(recommendations.begin(), recommendations.begin() + (k - 1),
+                             recommendations.end(), byCount);
+            recommendations.resize(k);
+        }
+
+        // Complete the winners' counts with the friends that were never expanded
+        work.friendsPruned = order.size() - processed;
+        for (auto& recommendation : recommendations) {
+            const FriendSet& candidateFriends = graph.at(recommendation.first);
+            for (size_t i = processed; i < order.size(); i++) {
+                recommendation.second += static_cast<int>(candidateFriends.count(order[i].second));
+            }
+        }
+        std::sort(recommendations.begin(), recommendations.end(), byCount);
+        blendColdStart(userId, filter, recommendations, k);
+        return recommendations;
+    }
+
+    // Method 2: Recommend friends based on network distance
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(
+        int userId, int maxDistance) const {
+        return recommendByNetworkDistance(userId, maxDistance, QueryOptions());
+    }
+
+    std::vector<std::pair<int, int>> recommendByNetworkDistance(
+        int userId, int maxDistance, const QueryOptions& options) const {
+        SM_METRIC_SCOPE("recommendByNetworkDistance");
+        
+        CountedMap<int, int, MemoryCategory::Workspaces> distances;
+        CountedSet<int, MemoryCategory::Workspaces> visited;
+        CandidateFilter filter = prepareFilter(userId, options);
+        std::queue<std::pair<int, int>> queue;
+
+        // Start BFS from the user
+        queue.push({userId, 0});
+        visited.insert(userId);
+
+        while (!queue.empty()) {
+            int currentUser = queue.front().first;
+            int currentDistance = queue.front().second;
+            queue.pop();
+
+            // Stop if we've exceeded max distance
+            if (currentDistance > maxDistance) {
+                break;
+            }
+            if (currentUser != userId && !expandThrough(currentUser, options)) {
+                continue;
+            }
+
+            // Check friends of current user
+            for (int neighbor : friendsOf(currentUser)) {
+                if (visited.count(neighbor) == 0) {
+                    visited.insert(neighbor);
+                    queue.push({neighbor, currentDistance + 1});
+
+                    // If not direct friend, consider for recommendation
+                    if (neighbor != userId && graph.at(userId).count(neighbor) == 0 &&
+                        admitCandidate(filter, neighbor)) {
+                        distances[neighbor] = currentDistance + 1;
+                    }
+                }
+            }
+        }
+
+        // Convert to vector for sorting; a boost below 1 only reorders users at equal distance
+        std::vector<ScoredCandidate> candidates;
+        candidates.reserve(distances.size());
+        for (const auto& pair : distances) {
+            candidates.push_back({pair.first, pair.second,
+                                  pair.second - (rankBoost(userId, pair.first, options) - 1.0)});
+        }
+
+        // Sort by network distance
+        std::vector<std::pair<int, int>> recommendations = rankCandidates(candidates, false);
+        blendColdStart(userId, filter, recommendations);
+        return recommendations;
+    }
+
+    // Advanced recommendation with weighted scoring
+    std::vector<std::pair<int, int>> advancedRecommendation(int userId,int maxDistance) const {
+        return advancedRecommendation(userId, maxDistance, QueryOptions());
+    }
+
+    std::vector<std::pair<int, int>> advancedRecommendation(int userId, int maxDistance,
+                                                            const QueryOptions& options) const {
+        SM_METRIC_SCOPE("advancedRecommendation");
+        CountedMap<int, double, MemoryCategory::Workspaces> recommendationScores;
+        CandidateFilter filter = prepareFilter(userId, options);
+
+        // Get user's friends
+        const FriendSet& userFriends = friendsOf(userId);
+
+        // Compute recommendations
+        for (int currentFriend : userFriends) {
+            if (!expandThrough(currentFriend, options)) {
+                continue;
+            }
+            for (int friendOfFriend : friendsOf(currentFriend)) {
+                // Skip if already a friend or the user itself
+                if (friendOfFriend == userId || userFriends.count(friendOfFriend) ||
+                    !admitCandidate(filter, friendOfFriend)) {
+                    continue;
+                }
+
+                // Compute weighted score
+                // 1. Common friends factor
+                double commonFriends = 0;
+                for (int commonFriend : userFriends) {
+                    if (friendsOf(friendOfFriend).count(commonFriend)) {
+                        commonFriends += commonFriendWeight(userId, commonFriend, options);
+                    }
+                }
+
+                // 2. Network proximity factor
+                int distance = networkDistance(userId, friendOfFriend);
+
+                // Combine factors
+                double score = (commonFriends * 2) + (1.0 / (distance + 1));
+                recommendationScores[friendOfFriend] += score;
+            }
+        }
+
+        // Convert to vector for sorting
+        std::vector<ScoredCandidate> candidates;
+        candidates.reserve(recommendationScores.size());
+        for (const auto& pair : recommendationScores) {
+            int score = static_cast<int>(pair.second);
+            candidates.push_back({pair.first, score, score * rankBoost(userId, pair.first, options)});
+        }
+
+        // Sort by score in descending order
+        std::vector<std::pair<int, int>> recommendations = rankCandidates(candidates, true);
+        blendColdStart(userId, filter, recommendations);
+        return recommendations;
+    }
+
+    // Helper method to get network distance between two users
+    int getNetworkDistance(int userId1, int userId2) const {
+        SM_METRIC_SCOPE("getNetworkDistance");
+        return networkDistance(userId1, userId2);
+    }
+
+    // Build a CSR snapshot of the current graph
+    GraphSnapshot buildSnapshot() const {
+        SM_METRIC_SCOPE("buildSnapshot");
+        GraphSnapshot result;
+        result.ids.reserve(graph.size());
+        for (const auto& entry : graph) {
+            result.ids.push_back(entry.first);
+        }
+        std::sort(result.ids.begin(), result.ids.end());
+
+        size_t n = result.ids.size();
+        result.index.reserve(n);
+        for (size_t v = 0; v < n; v++) {
+            result.index[result.ids[v]] = static_cast<int>(v);
+        }
+
+        result.offsets.assign(n + 1, 0);
+        for (size_t v = 0; v < n; v++) {
+            result.offsets[v + 1] = result.offsets[v] + graph.at(result.ids[v]).size();
+        }
+        result.neighbors.resize(result.offsets[n]);
+
+        parallelFor(0, n, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++) {
+                int* row = result.neighbors.data() + result.offsets[v];
+                size_t count = 0;
+                for (int friendId : graph.at(result.ids[v])) {
+                    row[count++] = result.index.at(friendId);
+                }
+                std::sort(row, row + count);
+            }
+        });
+        return result;
+    }
+
+    // Snapshot kept for the analytics passes, rebuilt only after mutations
+    std::shared_ptr<const GraphSnapshot> currentSnapshot() {
+        SM_METRIC_SCOPE("currentSnapshot");
+        return refreshSnapshot();
+    }
+
+    // Never recommend excludedUserId to userId again (blocked or dismissed)
+    void excludeRecommendation(int userId, int excludedUserId) {
+        SM_METRIC_SCOPE("excludeRecommendation");
+        MutationGuard guard(*this);
+        FeedCapture capture = captureFeedsOfUsers({userId});
+        exclusions[userId].add(excludedUserId);
+        exclusionChanged(userId);
+        publishFeeds(capture);
+    }
+
+    // Allow a previously excluded user to be recommended again
+    void removeExclusion(int userId, int excludedUserId) {
+        SM_METRIC_SCOPE("removeExclusion");
+        MutationGuard guard(*this);
+        auto it = exclusions.find(userId);
+        if (it != exclusions.end()) {
+            FeedCapture capture = captureFeedsOfUsers({userId});
+            it->second.remove(excludedUserId);
+            if (it->second.users().empty()) {
+                exclusions.erase(it);
+            }
+            exclusionChanged(userId);
+            publishFeeds(capture);
+        }
+    }
+
+    bool isExcluded(int userId, int candidateId) const {
+        SM_METRIC_SCOPE("isExcluded");
+        return excluded(userId, candidateId);
+    }
+
+    // Write the graph and the exclusion lists in a binary snapshot format:
+    // "SMGS", version, then users with their friend lists, then exclusions
+    void saveSnapshot(std::ostream& out) const {
+        SM_METRIC_SCOPE("saveSnapshot");
+        out.write("SMGS", 4);
+        writeBinary<uint32_t>(out, 1);
+        writeBinary<uint64_t>(out, graph.size());
+        for (const auto& entry : graph) {
+            writeBinary<int32_t>(out, entry.first);
+            writeBinary<uint64_t>(out, entry.second.size());
+            for (int friendId : entry.second) {
+                writeBinary<int32_t>(out, friendId);
+            }
+        }
+        writeBinary<uint64_t>(out, exclusions.size());
+        for (const auto& entry : exclusions) {
+            writeBinary<int32_t>(out, entry.first);
+            writeBinary<uint64_t>(out, entry.second.users().size());
+            for (int excludedId : entry.second.users()) {
+                writeBinary<int32_t>(out, excludedId);
+            }
+        }
+        if (!out) {
+            throw std::runtime_error("Failed to write graph snapshot");
+        }
+    }
+
+    // Replace the graph and exclusion lists with a saved snapshot. Derived
+    // indexes (communities, cores, embeddings...) must be recomputed.
+    void loadSnapshot(std::istream& in) {
+        SM_METRIC_SCOPE("loadSnapshot");
+        MutationGuard guard(*this);
+        char magic[4];
+        if (!in.read(magic, 4) || std::memcmp(magic, "SMGS", 4) != 0) {
+            throw std::runtime_error("Not a graph snapshot");
+        }
+        if (readBinary<uint32_t>(in) != 1) {
+            throw std::runtime_error("Unsupported graph snapshot version");
+        }
+
+        AdjacencyMap loaded;
+        uint64_t userCount = readBinary<uint64_t>(in);
+        loaded.reserve(userCount);
+        for (uint64_t i = 0; i < userCount; i++) {
+            FriendSet& friendSet = loaded[readBinary<int32_t>(in)];
+            uint64_t degree = readBinary<uint64_t>(in);
+            friendSet.reserve(degree);
+            for (uint64_t j = 0; j < degree; j++) {
+                friendSet.insert(readBinary<int32_t>(in));
+            }
+        }
+
+        CountedMap<int, ExclusionList, MemoryCategory::Indexes> loadedExclusions;
+        uint64_t listCount = readBinary<uint64_t>(in);
+        for (uint64_t i = 0; i < listCount; i++) {
+            int userId = readBinary<int32_t>(in);
+            std::vector<int> excluded(readBinary<uint64_t>(in));
+            for (int& excludedId : excluded) {
+                excludedId = readBinary<int32_t>(in);
+            }
+            loadedExclusions[userId].assign(std::move(excluded));
+        }
+
+        graph.swap(loaded);
+        exclusions.swap(loadedExclusions);
+        if (history) {
+            enableVersioning();
+        }
+        communities = CommunityAssignment();
+        triangles = TriangleIndex();
+        cores = CoreIndex();
+        components = ComponentIndex();
+        pageRanks = PageRankIndex();
+        embeddingSnapshot.reset();
+        embeddingIndex = HnswIndex();
+        version++;
+        if (coldStart.enabled) {
+            refreshColdStart();
+        }
+        if (scheduler) {
+            scheduler->markAllStale();
+        }
+        publishResync();
+    }
+
+    // Replace the whole graph with the given undirected edges (plus any
+    // isolated users). The CSR is built in parallel and becomes the current
+    // snapshot; the hash adjacency is filled from its rows with exact reserves.
+    void loadEdges(const std::vector<std::pair<int, int>>& edges, const std::vector<int>& users = {}) {
+        SM_METRIC_SCOPE("loadEdges");
+        MutationGuard guard(*this);
+        auto built = std::make_shared<const GraphSnapshot>(buildSnapshotFromEdges(edges.data(), edges.size(), users));
+
+        AdjacencyMap loaded;
+        loaded.reserve(built->vertexCount());
+        for (size_t v = 0; v < built->vertexCount(); v++) {
+            FriendSet& friendSet = loaded[built->ids[v]];
+            friendSet.reserve(built->degree(static_cast<int>(v)));
+            for (const int* it = built->begin(static_cast<int>(v)); it != built->end(static_cast<int>(v)); ++it) {
+                friendSet.insert(built->ids[*it]);
+            }
+        }
+
+        graph.swap(loaded);
+        if (history) {
+            enableVersioning();
+        }
+        communities = CommunityAssignment();
+        triangles = TriangleIndex();
+        cores = CoreIndex();
+        components = ComponentIndex();
+        pageRanks = PageRankIndex();
+        embeddingSnapshot.reset();
+        embeddingIndex = HnswIndex();
+        version++;
+        if (coldStart.enabled) {
+            refreshColdStart();
+        }
+        if (scheduler) {
+            scheduler->markAllStale();
+        }
+        publishResync();
+        snapshot = built;
+        snapshotVersion = version;
+    }
+
+    // Start mirroring the graph into a persistent representation so that
+    // versions can be retained and queried later
+    void enableVersioning() {
+        SM_METRIC_SCOPE("enableVersioning");
+        history.reset(new PersistentGraph());
+        for (const auto& entry : graph) {
+            history->addUser(entry.first);
+            for (int friendId : entry.second) {
+                if (entry.first <= friendId) {
+                    history->addConnection(entry.first, friendId);
+                }
+            }
+        }
+    }
+
+    // Keep the current state queryable; returns its version number. O(1):
+    // later mutations copy only the adjacency they change.
+    uint64_t retainVersion() {
+        SM_METRIC_SCOPE("retainVersion");
+        if (!history) {
+            enableVersioning();
+        }
+        retainedVersions[version] = history->snapshot();
+        return version;
+    }
+
+    void releaseVersion(uint64_t versionId) {
+        SM_METRIC_SCOPE("releaseVersion");
+        retainedVersions.erase(versionId);
+    }
+
+    std::vector<uint64_t> getRetainedVersions() const {
+        SM_METRIC_SCOPE("getRetainedVersions");
+        std::vector<uint64_t> versions;
+        for (const auto& entry : retainedVersions) {
+            versions.push_back(entry.first);
+        }
+        return versions;
+    }
+
+    // Method 1 as of a retained version; throws std::out_of_range for unknown versions
+    std::vector<std::pair<int, int>> recommendByCommonFriendsAt(uint64_t versionId, int userId) const {
+        SM_METRIC_SCOPE("recommendByCommonFriendsAt");
+        return retainedVersions.at(versionId).recommendByCommonFriends(userId);
+    }
+
+    // Method 2 as of a retained version; throws std::out_of_range for unknown versions
+    std::vector<std::pair<int, int>> recommendByNetworkDistanceAt(uint64_t versionId, int userId,
+                                                                  int maxDistance) const {
+        SM_METRIC_SCOPE("recommendByNetworkDistanceAt");
+        return retainedVersions.at(versionId).recommendByNetworkDistance(userId, maxDistance);
+    }
+
+    // Write the current graph in the semi-external on-disk layout, for
+    // serving it later through SemiExternalGraph without loading it into RAM
+    void writeSemiExternal(const std::string& path) {
+        SM_METRIC_SCOPE("writeSemiExternal");
+        SemiExternalGraph::write(*refreshSnapshot(), path);
+    }
+
+    // Set a user attribute such as country or school; an empty value clears it
+    void setUserAttribute(int userId, const std::string& attribute, const std::string& value) {
+        SM_METRIC_SCOPE("setUserAttribute");
+        MutationGuard guard(*this);
+        attributes.set(userId, attribute, value);
+    }
+
+    // Value of a user attribute, or an empty string if it is not set
+    std::string getUserAttribute(int userId, const std::string& attribute) const {
+        SM_METRIC_SCOPE("getUserAttribute");
+        return attributes.get(userId, attribute);
+    }
+
+    // Detect communities on the current snapshot; later addConnection calls
+    // update the assignment of their endpoints incrementally
+    void detectCommunities(CommunityAlgorithm algorithm = CommunityAlgorithm::Louvain) {
+        SM_METRIC_SCOPE("detectCommunities");
+        MutationGuard guard(*this);
+        const GraphSnapshot& current = *refreshSnapshot();
+        std::vector<int32_t> labels = algorithm == CommunityAlgorithm::Louvain
+            ? louvain(current)
+            : labelPropagation(current);
+
+        // Relabel to dense ids so the array stays compact
+        std::unordered_map<int32_t, int32_t> dense;
+        communities = CommunityAssignment();
+        communities.ids.assign(current.ids.begin(), current.ids.end());
+        communities.slotOf.insert(current.index.begin(), current.index.end());
+        communities.community.resize(labels.size());
+        for (size_t v = 0; v < labels.size(); v++) {
+            auto inserted = dense.insert({labels[v], static_cast<int32_t>(dense.size())});
+            communities.community[v] = inserted.first->second;
+        }
+        communities.communityCount = static_cast<int32_t>(dense.size());
+    }
+
+    // Community of a user, or -1 if communities have not been detected for them
+    int32_t getCommunity(int userId) const {
+        SM_METRIC_SCOPE("getCommunity");
+        return communities.communityOf(userId);
+    }
+
+    // Batch link prediction: write every pair of users whose friend sets have
+    // Jaccard similarity >= threshold to out, returns the number of pairs
+    size_t similarityJoin(double threshold, std::ostream& out, bool includeConnected = true) {
+        SM_METRIC_SCOPE("similarityJoin");
+        SimilarPairWriter writer(out);
+        return ::similarityJoin(*refreshSnapshot(), threshold, writer, includeConnected);
+    }
+
+    // Count triangles on the current snapshot to get per-edge embeddedness
+    // and per-user clustering coefficients
+    void computeTieStrength() {
+        SM_METRIC_SCOPE("computeTieStrength");
+        triangles = countTriangles(refreshSnapshot());
     }
 
-    // Get direct friends of a user
-    std::unordered_set<int> getFriends(int userId) const {
-        auto it = graph.find(userId);
-        if (it != graph.end()) {
-            return it->second;
+    // Number of triangles through an edge, as of the last computeTieStrength()
+    int getEmbeddedness(int userId1, int userId2) const {
+        SM_METRIC_SCOPE("getEmbeddedness");
+        if (triangles.empty()) {
+            return 0;
         }
-        return {};
+        int u = triangles.snapshot->vertexOf(userId1);
+        int v = triangles.snapshot->vertexOf(userId2);
+        long long slot = u < 0 || v < 0 ? -1 : triangles.slotOf(u, v);
+        return slot < 0 ? 0 : static_cast<int>(triangles.embeddedness[slot]);
     }
 
-    // Method 1: Recommend friends based on common friends
-    std::vector<std::pair<int, int>> recommendByCommonFriends(int userId) const {
-        // Map to store potential friends and their common friend count
-        std::unordered_map<int, int> potentialFriends;
+    // Local clustering coefficient, as of the last computeTieStrength()
+    double getClusteringCoefficient(int userId) const {
+        SM_METRIC_SCOPE("getClusteringCoefficient");
+        int vertex = triangles.empty() ? -1 : triangles.snapshot->vertexOf(userId);
+        return vertex < 0 ? 0.0 : triangles.clustering[vertex];
+    }
 
-        // Get user's existing friends
-        auto userFriends = getFriends(userId);
+    // Compute the core number of every user on the current snapshot
+    void computeCoreNumbers(bool parallel = true) {
+        SM_METRIC_SCOPE("computeCoreNumbers");
+        MutationGuard guard(*this);
+        cores = CoreIndex();
+        cores.snapshot = refreshSnapshot();
+        std::vector<int32_t> core = parallel ? parallelCoreDecomposition(*cores.snapshot)
+                                             : coreDecomposition(*cores.snapshot);
+        cores.core.assign(core.begin(), core.end());
+        for (int32_t core : cores.core) {
+            cores.maxCore = std::max(cores.maxCore, core);
+        }
+    }
 
-        // Find friends of friends
-        for (int currentFriend : userFriends) {
-            for (int friendOfFriend : getFriends(currentFriend)) {
-                // Skip if already a friend or the user itself
-                if (friendOfFriend == userId || userFriends.count(friendOfFriend)) {
-                    continue;
-                }
+    // Core number as of the last computeCoreNumbers(), or -1 if unknown
+    int getCoreNumber(int userId) const {
+        SM_METRIC_SCOPE("getCoreNumber");
+        return cores.coreOf(userId);
+    }
 
-                // Increment common friends count
-                potentialFriends[friendOfFriend]++;
+    // Find the connected components of the current snapshot
+    void computeComponents() {
+        SM_METRIC_SCOPE("computeComponents");
+        components = ComponentIndex();
+        components.snapshot = refreshSnapshot();
+        std::vector<int32_t> labels = connectedComponents(*components.snapshot);
+
+        // Labels are the smallest vertex of each component; renumber densely
+        std::vector<int32_t> dense(labels.size(), -1);
+        components.component.resize(labels.size());
+        for (size_t v = 0; v < labels.size(); v++) {
+            if (dense[labels[v]] < 0) {
+                dense[labels[v]] = static_cast<int32_t>(components.componentSize.size());
+                components.componentSize.push_back(0);
             }
+            components.component[v] = dense[labels[v]];
+            components.componentSize[dense[labels[v]]]++;
         }
+    }
 
-        // Convert to vector for sorting
-        std::vector<std::pair<int, int>> recommendations;
-        for (const auto& pair : potentialFriends) {
-            recommendations.push_back(pair);
-        }
+    // Component of a user as of the last computeComponents(), or -1 if unknown
+    int getComponent(int userId) const {
+        SM_METRIC_SCOPE("getComponent");
+        return components.componentOf(userId);
+    }
 
-        // Sort by number of common friends in descending order
-        std::sort(recommendations.begin(), recommendations.end(), 
-            [](const auto& a, const auto& b) {
-                return a.second > b.second;
-            });
+    // Number of users in the component of a user, or 0 if unknown
+    size_t getComponentSize(int userId) const {
+        SM_METRIC_SCOPE("getComponentSize");
+        int32_t component = components.componentOf(userId);
+        return component < 0 ? 0 : components.componentSize[component];
+    }
 
-        return recommendations;
+    // Capacity-planning statistics of the current graph, see profileGraph
+    GraphProfile profile(size_t samples = 1000) {
+        SM_METRIC_SCOPE("profile");
+        return profileGraph(*refreshSnapshot(), samples, NumaTopology::detect().nodes.size());
     }
 
-    // Method 2: Recommend friends based on network distance
-    std::vector<std::pair<int, int>> recommendByNetworkDistance(
-        int userId, int maxDistance) const {
-        
-        std::unordered_map<int, int> distances;
-        std::unordered_set<int> visited;
-        std::queue<std::pair<int, int>> queue;
+    // Compute PageRank on the current snapshot; returns the iterations run.
+    // A previous result seeds the iteration (matched by user id), so a
+    // refresh after a batch of mutations converges in a few iterations.
+    size_t computePageRank(const PageRankConfig& config = PageRankConfig()) {
+        SM_METRIC_SCOPE("computePageRank");
+        auto current = refreshSnapshot();
+        FloatArray rank;
+        if (!pageRanks.empty()) {
+            rank.resize(current->vertexCount());
+            for (size_t v = 0; v < rank.size(); v++) {
+                rank[v] = pageRanks.rankOf(current->ids[v]);
+            }
+        }
+        PageRankIndex result;
+        result.snapshot = current;
+        result.iterations = pageRank(*current, config, rank);
+        result.rank.swap(rank);
+        for (float value : result.rank) {
+            result.maxRank = std::max(result.maxRank, value);
+        }
+        pageRanks = std::move(result);
+        return pageRanks.iterations;
+    }
 
-        // Start BFS from the user
-        queue.push({userId, 0});
-        visited.insert(userId);
+    // PageRank as of the last computePageRank(), or 0 if unknown
+    double getPageRank(int userId) const {
+        SM_METRIC_SCOPE("getPageRank");
+        return pageRanks.rankOf(userId);
+    }
 
-        while (!queue.empty()) {
-            int currentUser = queue.front().first;
-            int currentDistance = queue.front().second;
-            queue.pop();
+    // Subscribe to changes of users' top-k common-friend lists. Every
+    // mutation recomputes the lists of its endpoints and their friends and
+    // publishes one delta per list that changed; see ChangeFeed for
+    // exclusions and bulk loads. The subscription ends when the returned
+    // feed is released.
+    std::shared_ptr<ChangeFeed> subscribeChanges(size_t k = 10, size_t queueCapacity = 4096) {
+        SM_METRIC_SCOPE("subscribeChanges");
+        auto feed = std::make_shared<ChangeFeed>(k, queueCapacity);
+        changeFeeds.push_back(feed);
+        return feed;
+    }
 
-            // Stop if we've exceeded max distance
-            if (currentDistance > maxDistance) {
-                break;
-            }
+    // Start background workers that keep the top-k common-friend lists of
+    // active users fresh in the precomputed store, see PrecomputeScheduler.
+    // Mutations may run concurrently with the workers; other queries must
+    // still not overlap with mutations.
+    void startPrecompute(size_t k = 10, const PrecomputeScheduler::Config& config = PrecomputeScheduler::Config()) {
+        SM_METRIC_SCOPE("startPrecompute");
+        stopPrecompute();
+        precomputeK = k;
+        scheduler.reset(new PrecomputeScheduler(config, [this](int userId) {
+            std::shared_lock<std::shared_mutex> lock(stateMutex);
+            precomputed.put(userId, recommendTopKByCommonFriends(userId, precomputeK), version);
+        }));
+    }
 
-            // Check friends of current user
-            for (int neighbor : getFriends(currentUser)) {
-                if (visited.count(neighbor) == 0) {
-                    visited.insert(neighbor);
-                    queue.push({neighbor, currentDistance + 1});
+    void stopPrecompute() {
+        SM_METRIC_SCOPE("stopPrecompute");
+        scheduler.reset();
+        precomputed.clear();
+    }
 
-                    // If not direct friend, consider for recommendation
-                    if (neighbor != userId && graph.at(userId).count(neighbor) == 0) {
-                        distances[neighbor] = currentDistance + 1;
-                    }
-                }
-            }
+    // Record that a user is active, raising their precompute priority
+    void recordActivity(int userId) {
+        SM_METRIC_SCOPE("recordActivity");
+        if (scheduler) {
+            scheduler->recordActivity(userId);
         }
+    }
 
-        // Convert to vector for sorting
-        std::vector<std::pair<int, int>> recommendations;
-        for (const auto& pair : distances) {
-            recommendations.push_back(pair);
+    // Serve the precomputed list of a user and count the request as
+    // activity. Returns false if nothing has been computed for the user yet
+    // or since their exclusions last changed; stale is set when mutations
+    // have touched their neighbourhood since.
+    // Safe to call from any thread while precompute is running.
+    bool getPrecomputedRecommendations(int userId, std::vector<std::pair<int, int>>& recommendations,
+                                       bool* stale = nullptr) {
+        SM_METRIC_SCOPE("getPrecomputedRecommendations");
+        if (!scheduler) {
+            return false;
         }
-
-        // Sort by network distance
-        std::sort(recommendations.begin(), recommendations.end(), 
-            [](const auto& a, const auto& b) {
-                return a.second < b.second;
-            });
-
-        return recommendations;
+        scheduler->recordActivity(userId);
+        PrecomputedStore::Entry entry;
+        if (!precomputed.get(userId, entry)) {
+            return false;
+        }
+        recommendations.assign(entry.recommendations.begin(), entry.recommendations.end());
+        if (stale) {
+            *stale = scheduler->isStale(userId);
+        }
+        return true;
     }
 
-    // Advanced recommendation with weighted scoring
-    std::vector<std::pair<int, int>> advancedRecommendation(int userId,int maxDistance) const {
-        std::unordered_map<int, double> recommendationScores;
+    PrecomputeScheduler::Stats getPrecomputeStats() const {
+        SM_METRIC_SCOPE("getPrecomputeStats");
+        return scheduler ? scheduler->stats() : PrecomputeScheduler::Stats();
+    }
 
-        // Get user's friends
-        auto userFriends = getFriends(userId);
+    // Serve popular users to users with fewer than config.degreeThreshold
+    // friends: their recommendations are topped up from precomputed top
+    // lists, refreshed every config.refreshEvery graph changes
+    void enableColdStart(const ColdStartConfig& config = ColdStartConfig()) {
+        SM_METRIC_SCOPE("enableColdStart");
+        MutationGuard guard(*this);
+        coldStartConfig = config;
+        coldStart.enabled = true;
+        refreshColdStart();
+    }
 
-        // Compute recommendations
-        for (int currentFriend : userFriends) {
-            for (int friendOfFriend : getFriends(currentFriend)) {
-                // Skip if already a friend or the user itself
-                if (friendOfFriend == userId || userFriends.count(friendOfFriend)) {
-                    continue;
-                }
+    void disableColdStart() {
+        SM_METRIC_SCOPE("disableColdStart");
+        MutationGuard guard(*this);
+        coldStart = ColdStartLists();
+    }
 
-                // Compute weighted score
-                // 1. Common friends factor
-                int commonFriends = 0;
-                for (int commonFriend : userFriends) {
-                    if (getFriends(friendOfFriend).count(commonFriend)) {
-                        commonFriends++;
-                    }
+    // Rebuild the cold-start lists from the last PageRank, or from degrees
+    // if PageRank has not been computed
+    void refreshColdStart() {
+        SM_METRIC_SCOPE("refreshColdStart");
+        MutationGuard guard(*this);
+        TopList global(coldStartConfig.listSize);
+        std::unordered_map<std::string, TopList> buckets;
+        for (const auto& entry : graph) {
+            float score = pageRanks.empty() ? static_cast<float>(entry.second.size())
+                                            : pageRanks.rankOf(entry.first);
+            global.offer(entry.first, score);
+            if (!coldStartConfig.bucketAttribute.empty()) {
+                std::string value = attributes.get(entry.first, coldStartConfig.bucketAttribute);
+                if (!value.empty()) {
+                    buckets.emplace(value, TopList(coldStartConfig.listSize)).first->second.offer(entry.first, score);
                 }
-
-                // 2. Network proximity factor
-                int networkDistance = getNetworkDistance(userId, friendOfFriend);
-
-                // Combine factors
-                double score = (commonFriends * 2) + (1.0 / (networkDistance + 1));
-                recommendationScores[friendOfFriend] += score;
             }
         }
-
-        // Convert to vector for sorting
-        std::vector<std::pair<int, int>> recommendations;
-        for (const auto& pair : recommendationScores) {
-            recommendations.push_back({pair.first, static_cast<int>(pair.second)});
+        coldStart.global = global.take();
+        coldStart.buckets.clear();
+        for (auto& bucket : buckets) {
+            coldStart.buckets[bucket.first] = bucket.second.take();
         }
-
-        // Sort by score in descending order
-        std::sort(recommendations.begin(), recommendations.end(), 
-            [](const auto& a, const auto& b) {
-                return a.second > b.second;
-            });
-
-        return recommendations;
+        coldStart.builtAtVersion = version;
     }
 
-    // Helper method to get network distance between two users
-    int getNetworkDistance(int userId1, int userId2) const {
-        std::unordered_set<int> visited;
-        std::queue<std::pair<int, int>> queue;
+    // Compute FastRP embeddings for every user and index them for ANN search
+    void buildEmbeddings(const FastRPConfig& config = FastRPConfig(),
+                         const HnswIndex::Config& indexConfig = HnswIndex::Config()) {
+        SM_METRIC_SCOPE("buildEmbeddings");
+        embeddingSnapshot = refreshSnapshot();
+        embeddingIndex.build(computeFastRP(*embeddingSnapshot, config), indexConfig);
+    }
 
-        queue.push({userId1, 0});
-        visited.insert(userId1);
+    // Method 3: Recommend the k users with the most similar embeddings.
+    // Returns (user, cosine similarity) pairs; existing friends are skipped.
+    std::vector<std::pair<int, float>> recommendByEmbedding(int userId, size_t k) const {
+        SM_METRIC_SCOPE("recommendByEmbedding");
+        std::vector<std::pair<int, float>> recommendations;
+        int vertex = embeddingSnapshot ? embeddingSnapshot->vertexOf(userId) : -1;
+        if (vertex < 0 || k == 0) {
+            return recommendations;
+        }
 
-        while (!queue.empty()) {
-            int currentUser = queue.front().first;
-            int distance = queue.front().second;
-            queue.pop();
+        auto userIt = graph.find(userId);
+        size_t friendCount = userIt == graph.end() ? 0 : userIt->second.size();
+        // Over-fetch so that the user and their friends can be filtered out
+        size_t fetch = k + friendCount + 1;
+        auto found = embeddingIndex.search(embeddingIndex.vectors().row(vertex), fetch, fetch + 64);
 
-            if (currentUser == userId2) {
-                return distance;
+        for (const auto& hit : found) {
+            int candidate = embeddingSnapshot->ids[hit.first];
+            if (candidate == userId ||
+                (userIt != graph.end() && userIt->second.count(candidate))) {
+                continue;
             }
-
-            for (int neighbor : getFriends(currentUser)) {
-                if (visited.count(neighbor) == 0) {
-                    visited.insert(neighbor);
-                    queue.push({neighbor, distance + 1});
-                }
+            recommendations.push_back({candidate, 1.0f - hit.second});
+            if (recommendations.size() == k) {
+                break;
             }
         }
-
-        // No path found
-        return std::numeric_limits<int>::max();
+        return recommendations;
     }
 
     // Get total number of users in the network
     size_t getTotalUsers() const {
+        SM_METRIC_SCOPE("getTotalUsers");
         return graph.size();
     }
 
     // Print entire network structure (for debugging)
     void printNetwork() const {
+        SM_METRIC_SCOPE("printNetwork");
         for (const auto& entry : graph) {
             int userId = entry.first;
-            const std::unordered_set<int>& friendSet = entry.second;
+            const FriendSet& friendSet = entry.second;
             
             std::cout << "User " << userId << " is connected to: ";
             for (int friendId : friendSet) {
@@ -235,6 +7047,223 @@ public:
     }
 };
 
+// Line-oriented TCP front end for operating a SocialNetwork, bound to
+// 127.0.0.1 only. Each connection gets a thread; commands run one at a time
+// because queries must not overlap with mutations. Every reply ends with a
+// line "OK" or "ERR <message>".
+//   ADD <user> <user>     REMOVE <user> <user>     RECOMMEND <user> [k]
+//   MEMORY                METRICS                  QUIT
+//   SHUTDOWN
+// METRICS prints Prometheus text. Clients never name files; a dump file for
+// a textfile collector is configured on the serve command line instead.
+class CommandServer {
+public:
+    // Port 0 picks a free port, see port()
+    CommandServer(SocialNetwork& served, uint16_t port) : network(served) {
+        listener = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listener < 0) {
+            throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+        }
+        int reuse = 1;
+        ::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(listener, 16) != 0 ||
+            ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            std::string reason = std::strerror(errno);
+            ::close(listener);
+            throw std::runtime_error("Cannot listen on 127.0.0.1:" + std::to_string(port) + ": " + reason);
+        }
+        boundPort = ntohs(address.sin_port);
+    }
+
+    CommandServer(const CommandServer&) = delete;
+    CommandServer& operator=(const CommandServer&) = delete;
+
+    ~CommandServer() {
+        stop();
+        for (auto& client : clients) {
+            client.join();
+        }
+        ::close(listener);
+    }
+
+    uint16_t port() const { return boundPort; }
+
+    // Accept connections until stop() or a SHUTDOWN command
+    void run() {
+        for (;;) {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            std::lock_guard<std::mutex> lock(clientsMutex);
+            if (stopping) {
+                ::close(fd);
+                break;
+            }
+            clientFds.push_back(fd);
+            clients.emplace_back([this, fd]() { serveClient(fd); });
+        }
+    }
+
+    // Wake the accept loop and disconnect every client
+    void stop() {
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        stopping = true;
+        ::shutdown(listener, SHUT_RDWR);
+        for (int fd : clientFds) {
+            ::shutdown(fd, SHUT_RDWR);
+        }
+    }
+
+    // Run one command line and return its reply; usable without a socket
+    std::string execute(const std::string& line) {
+        std::istringstream in(line);
+        std::ostringstream out;
+        std::string command;
+        in >> command;
+        command = upperCase(command);
+        std::lock_guard<std::mutex> lock(commandMutex);
+        try {
+            if (command == "ADD" || command == "REMOVE") {
+                int userId1;
+                int userId2;
+                if (!(in >> userId1 >> userId2)) {
+                    return "ERR usage: " + command + " <user> <user>\n";
+                }
+                if (command == "ADD") {
+                    network.addConnection(userId1, userId2);
+                } else {
+                    network.removeConnection(userId1, userId2);
+                }
+            } else if (command == "RECOMMEND") {
+                int userId;
+                size_t k = 10;
+                // k is optional, but anything given in its place must be a count
+                std::string kText;
+                if (!(in >> userId) || ((in >> kText) && !parseCount(kText, k))) {
+                    return "ERR usage: RECOMMEND <user> [k]\n";
+                }
+                for (const auto& recommendation : network.recommendTopKByCommonFriends(userId, k)) {
+                    out << recommendation.first << " " << recommendation.second << "\n";
+                }
+            } else if (command == "MEMORY") {
+                MemoryStats stats = memoryStats();
+                for (const auto& category : stats.categories) {
+                    out << category.name << " requested=" << category.requestedBytes
+                        << " heap=" << category.heapBytes << " peak=" << category.peakHeapBytes
+                        << " allocations=" << category.allocations << "\n";
+                }
+                out << "total requested=" << stats.requestedBytes << " heap=" << stats.heapBytes
+                    << " users=" << network.getTotalUsers() << "\n";
+            } else if (command == "METRICS") {
+                writePrometheusMetrics(out);
+            } else if (command == "QUIT" || command == "SHUTDOWN" || command.empty()) {
+                // Handled by the connection loop; the empty line is a no-op
+            } else {
+                return "ERR unknown command " + command + "\n";
+            }
+        } catch (const std::exception& e) {
+            return std::string("ERR ") + e.what() + "\n";
+        }
+        out << "OK\n";
+        return out.str();
+    }
+
+private:
+    SocialNetwork& network;
+    int listener = -1;
+    uint16_t boundPort = 0;
+    std::mutex commandMutex;
+    std::mutex clientsMutex;
+    bool stopping = false;
+    std::vector<int> clientFds;
+    std::vector<std::thread> clients;
+
+    static std::string upperCase(std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+        return text;
+    }
+
+    // Whole-token unsigned decimal, unlike operator>> which stops at trailing
+    // junk and wraps negative numbers
+    static bool parseCount(const std::string& text, size_t& value) {
+        if (text.empty() || !std::all_of(text.begin(), text.end(), [](unsigned char c) { return std::isdigit(c); })) {
+            return false;
+        }
+        errno = 0;
+        unsigned long long parsed = std::strtoull(text.c_str(), nullptr, 10);
+        if (errno == ERANGE) {
+            return false;
+        }
+        value = static_cast<size_t>(parsed);
+        return true;
+    }
+
+    static bool sendAll(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t written = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    void serveClient(int fd) {
+        std::string pending;
+        char buffer[4096];
+        bool open = true;
+        while (open) {
+            ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                break;
+            }
+            pending.append(buffer, static_cast<size_t>(received));
+            size_t newline;
+            while (open && (newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                std::string reply = execute(line);
+                open = sendAll(fd, reply);
+                std::string command;
+                std::istringstream(line) >> command;
+                command = upperCase(command);
+                if (command == "QUIT") {
+                    open = false;
+                } else if (command == "SHUTDOWN") {
+                    open = false;
+                    stop();
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(clientsMutex);
+        clientFds.erase(std::find(clientFds.begin(), clientFds.end(), fd));
+        ::close(fd);
+    }
+};
+
 // Demonstration function
 void demonstrateSocialNetwork() {
     SocialNetwork socialNetwork;
@@ -303,8 +7332,354 @@ void demonstrateSocialNetwork() {
     
 }
 
-int main() {
+// Print the capacity-planning profile of a saved graph snapshot as JSON:
+// profile [snapshot file] [samples]. Without a file a random graph with
+// bench-build's default size is profiled.
+void profileNetwork(const std::string& path, size_t samples) {
+    SocialNetwork socialNetwork;
+    if (path.empty()) {
+        std::mt19937_64 rng(7);
+        std::uniform_int_distribution<int> pick(0, 99999);
+        std::vector<std::pair<int, int>> edges(1000000);
+        for (auto& edge : edges) {
+            edge = {pick(rng), pick(rng)};
+        }
+        socialNetwork.loadEdges(edges);
+    } else {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        socialNetwork.loadSnapshot(in);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    GraphProfile profile = socialNetwork.profile(samples);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    profile.writeJson(std::cout);
+    std::cerr << "Profiled in " << elapsed * 1000.0 << " ms on " << ThreadPool::shared().size()
+              << " threads" << std::endl;
+}
+
+// Serve a network over the local command protocol:
+// serve [port] [snapshot file] [--metrics-file path]. With a metrics file the
+// Prometheus dump there is refreshed every metricsInterval and on exit.
+void serveNetwork(uint16_t port, const std::string& path, const std::string& metricsFile,
+                  std::chrono::seconds metricsInterval = std::chrono::seconds(15)) {
+    SocialNetwork socialNetwork;
+    if (!path.empty()) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        socialNetwork.loadSnapshot(in);
+    }
+    CommandServer server(socialNetwork, port);
+
+    std::mutex dumpMutex;
+    std::condition_variable dumpWake;
+    bool serving = true;
+    std::thread dumper;
+    if (!metricsFile.empty()) {
+        dumpPrometheusMetrics(metricsFile);     // report a bad path before serving
+        dumper = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(dumpMutex);
+            while (!dumpWake.wait_for(lock, metricsInterval, [&]() { return !serving; })) {
+                try {
+                    dumpPrometheusMetrics(metricsFile);
+                } catch (const std::exception& e) {
+                    std::cerr << "Metrics dump failed: " << e.what() << std::endl;
+                }
+            }
+        });
+    }
+
+    std::cout << "Listening on 127.0.0.1:" << server.port() << std::endl;
+    server.run();
+    if (dumper.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(dumpMutex);
+            serving = false;
+        }
+        dumpWake.notify_all();
+        dumper.join();
+        dumpPrometheusMetrics(metricsFile);
+    }
+}
+
+// Compare the parallel edge-list construction with the addConnection loop:
+// bench-build [edges] [users]
+void benchmarkConstruction(size_t edgeCount, int users) {
+    std::mt19937_64 rng(7);
+    std::uniform_int_distribution<int> pick(0, users - 1);
+    std::vector<std::pair<int, int>> edges(edgeCount);
+    for (auto& edge : edges) {
+        // The insert loop would store a self-loop as a friendship; the builder drops them.
+        // Needs at least two users, which main ensures.
+        do {
+            edge = {pick(rng), pick(rng)};
+        } while (edge.first == edge.second);
+    }
+    auto seconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto report = [edgeCount](const char* name, double elapsed) {
+        std::cout << name << ": " << elapsed * 1000.0 << " ms, "
+                  << edgeCount / elapsed / 1e6 << " M edges/s" << std::endl;
+    };
+
+    std::cout << "Edges: " << edgeCount << ", users: " << users
+              << ", threads: " << hardwareThreads() << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    SocialNetwork inserted;
+    for (const auto& edge : edges) {
+        inserted.addConnection(edge.first, edge.second);
+    }
+    GraphSnapshot reference = inserted.buildSnapshot();
+    report("addConnection loop + buildSnapshot", seconds(start));
+
+    start = std::chrono::steady_clock::now();
+    GraphSnapshot built = buildSnapshotFromEdges(edges.data(), edges.size());
+    report("buildSnapshotFromEdges", seconds(start));
+
+    start = std::chrono::steady_clock::now();
+    SocialNetwork loaded;
+    loaded.loadEdges(edges);
+    report("SocialNetwork::loadEdges", seconds(start));
+
+    bool match = reference.ids == built.ids && reference.offsets == built.offsets &&
+                 reference.neighbors == built.neighbors;
+    std::cout << "Snapshots match: " << (match ? "yes" : "no") << std::endl;
+}
+
+// Early-terminating top-k against the exact common-friend ranking:
+// bench-topk [friends] [noise candidates]. User 0 has `friends` friends, a
+// dozen candidates shared by most of them and a long tail of candidates
+// reached through a single friend; random users follow as a second workload.
+void benchmarkTopK(size_t friendCount, size_t noiseCount) {
+    const int heavy = 12;
+    const size_t k = 10;
+    std::mt19937_64 rng(17);
+    std::vector<std::pair<int, int>> edges;
+    int firstFriend = 1;
+    int firstHeavy = firstFriend + static_cast<int>(friendCount);
+    int firstNoise = firstHeavy + heavy;
+    int firstRandom = firstNoise + static_cast<int>(noiseCount);
+    for (size_t f = 0; f < friendCount; f++) {
+        int friendId = firstFriend + static_cast<int>(f);
+        edges.push_back({0, friendId});
+        for (int h = 0; h < heavy; h++) {
+            if (rng() % 10 < 9) {
+                edges.push_back({friendId, firstHeavy + h});
+            }
+        }
+    }
+    for (size_t c = 0; c < noiseCount; c++) {
+        edges.push_back({firstFriend + static_cast<int>(rng() % std::max<size_t>(friendCount, 1)),
+                         firstNoise + static_cast<int>(c)});
+    }
+    const int randomUsers = 20000;
+    std::uniform_int_distribution<int> pick(firstRandom, firstRandom + randomUsers - 1);
+    for (int e = 0; e < randomUsers * 10; e++) {
+        int a = pick(rng);
+        int b = pick(rng);
+        if (a != b) {
+            edges.push_back({a, b});
+        }
+    }
+    SocialNetwork socialNetwork;
+    socialNetwork.loadEdges(edges);
+
+    auto byCount = [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+    double topKSeconds = 0.0;
+    double exactSeconds = 0.0;
+    size_t pruned = 0;
+    size_t mismatches = 0;
+    std::vector<int> users = {0};
+    for (int u = 0; u < 200; u++) {
+        users.push_back(pick(rng));
+    }
+    for (int userId : users) {
+        QueryStats stats;
+        auto start = std::chrono::steady_clock::now();
+        auto topK = socialNetwork.recommendTopKByCommonFriends(userId, k, QueryOptions(), &stats);
+        auto middle = std::chrono::steady_clock::now();
+        auto exact = socialNetwork.recommendByCommonFriends(userId);
+        topKSeconds += std::chrono::duration<double>(middle - start).count();
+        exactSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - middle).count();
+        pruned += stats.friendsPruned;
+
+        // Every reported count must be exact and the counts must be the k
+        // best; which of several candidates tied at the k-th count is kept
+        // may differ from the id order of the full ranking
+        std::unordered_map<int, int> exactCount(exact.begin(), exact.end());
+        std::sort(exact.begin(), exact.end(), byCount);
+        exact.resize(std::min(exact.size(), k));
+        bool match = topK.size() == exact.size();
+        for (size_t i = 0; match && i < topK.size(); i++) {
+            match = topK[i].second == exact[i].second && exactCount[topK[i].first] == topK[i].second;
+        }
+        mismatches += !match;
+        if (userId == 0) {
+            std::cout << "Hub user: top-k " << std::chrono::duration<double>(middle - start).count() * 1000.0
+                      << " ms, " << stats.friendsPruned << " of " << friendCount << " friends pruned" << std::endl;
+        }
+    }
+    std::cout << "Queries: " << users.size() << ", top-k " << topKSeconds * 1000.0 << " ms, exact "
+              << exactSeconds * 1000.0 << " ms, friends pruned " << pruned << std::endl;
+    std::cout << "Mismatches against the exact ranking: " << mismatches << std::endl;
+}
+
+// Distance queries on the NUMA-partitioned graph, routed to the owning node
+// versus spread round-robin: bench-numa [edges] [users] [queries] [simulated nodes]
+void benchmarkNuma(size_t edgeCount, int users, size_t queries, size_t simulatedNodes) {
+    std::mt19937_64 rng(11);
+    std::uniform_int_distribution<int> pick(0, users - 1);
+    std::vector<std::pair<int, int>> edges(edgeCount);
+    for (auto& edge : edges) {
+        edge = {pick(rng), pick(rng)};
+    }
+    std::vector<int> sources(queries);
+    for (int& source : sources) {
+        source = pick(rng);
+    }
+
+    GraphSnapshot graph = buildSnapshotFromEdges(edges.data(), edges.size());
+    NumaPartitionedGraph partitioned(graph, simulatedNodes > 0 ? NumaTopology::simulated(simulatedNodes)
+                                                               : NumaTopology::detect());
+    std::cout << "Edges: " << edgeCount << ", users: " << users << ", queries: " << queries
+              << ", NUMA nodes: " << partitioned.nodeCount()
+              << (simulatedNodes > 0 ? " (simulated)" : "") << std::endl;
+
+    for (bool routed : {true, false}) {
+        partitioned.setRouting(routed);
+        partitioned.resetTraffic();
+        auto start = std::chrono::steady_clock::now();
+        partitioned.recommendBatchByNetworkDistance(sources, 2);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (routed ? "Routed to owner" : "Round-robin") << ": " << elapsed * 1000.0 << " ms" << std::endl;
+        for (const auto& node : partitioned.trafficByNode()) {
+            double total = static_cast<double>(node.localBytes + node.remoteBytes);
+            std::cout << "  node " << node.node << ": " << node.queries << " queries, "
+                      << node.localBytes / 1e6 << " MB local, " << node.remoteBytes / 1e6 << " MB remote ("
+                      << (total > 0 ? 100.0 * node.localBytes / total : 0.0) << "% local), "
+                      << total / 1e6 / elapsed << " MB/s" << std::endl;
+        }
+    }
+}
+
+// Partitioned queries over local worker processes, checked against the
+// in-process recommenders: cluster [workers] [edges] [users] [queries]
+void demonstrateCluster(size_t workerCount, size_t edgeCount, int users, size_t queries) {
+    std::mt19937_64 rng(13);
+    std::uniform_int_distribution<int> pick(0, users - 1);
+    std::vector<std::pair<int, int>> edges(edgeCount);
+    for (auto& edge : edges) {
+        do {
+            edge = {pick(rng), pick(rng)};
+        } while (edge.first == edge.second);
+    }
+    SocialNetwork socialNetwork;
+    socialNetwork.loadEdges(edges);
+    PartitionedCluster cluster(*socialNetwork.currentSnapshot(), workerCount);
+
+    std::cout << "Workers: " << cluster.workerCount() << std::endl;
+    for (const auto& worker : cluster.describe()) {
+        std::cout << "  pid " << worker.pid << ": vertices [" << worker.firstVertex << ", "
+                  << worker.lastVertex << "), " << worker.entries << " entries, "
+                  << worker.ghosts << " ghosts" << std::endl;
+    }
+
+    ClusterStats commonTotal;
+    ClusterStats distanceTotal;
+    size_t mismatches = 0;
+    for (size_t q = 0; q < queries; q++) {
+        int userId = pick(rng);
+        ClusterStats stats;
+        auto common = cluster.recommendByCommonFriends(userId, &stats);
+        commonTotal.rounds += stats.rounds;
+        commonTotal.messages += stats.messages;
+        commonTotal.bytes += stats.bytes;
+        auto expected = socialNetwork.recommendByCommonFriends(userId);
+        std::sort(common.begin(), common.end());
+        std::sort(expected.begin(), expected.end());
+        mismatches += common != expected;
+
+        auto distance = cluster.recommendByNetworkDistance(userId, 2, &stats);
+        distanceTotal.rounds += stats.rounds;
+        distanceTotal.messages += stats.messages;
+        distanceTotal.bytes += stats.bytes;
+        auto expectedDistance = socialNetwork.recommendByNetworkDistance(userId, 2);
+        std::sort(distance.begin(), distance.end());
+        std::sort(expectedDistance.begin(), expectedDistance.end());
+        mismatches += distance != expectedDistance;
+    }
+
+    auto report = [queries](const char* name, const ClusterStats& total) {
+        std::cout << name << " per query: " << double(total.rounds) / queries << " rounds, "
+                  << double(total.messages) / queries << " messages, "
+                  << double(total.bytes) / queries / 1024.0 << " KiB" << std::endl;
+    };
+    if (queries > 0) {
+        report("Common friends", commonTotal);
+        report("Network distance (2)", distanceTotal);
+    }
+    std::cout << "Mismatches against in-process results: " << mismatches << std::endl;
+}
+
+int main(int argc, char* argv[]) {
     try {
+        if (argc > 1 && std::string(argv[1]) == "cluster") {
+            size_t workerCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4;
+            size_t edgeCount = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 200000;
+            int users = argc > 4 ? std::atoi(argv[4]) : 50000;
+            size_t queries = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 100;
+            demonstrateCluster(workerCount, edgeCount, std::max(users, 2), queries);
+            return 0;
+        }
+        if (argc > 1 && std::string(argv[1]) == "bench-numa") {
+            size_t edgeCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+            int users = argc > 3 ? std::atoi(argv[3]) : 100000;
+            size_t queries = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 1000;
+            size_t simulatedNodes = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 0;
+            benchmarkNuma(edgeCount, std::max(users, 1), queries, simulatedNodes);
+            return 0;
+        }
+        if (argc > 1 && std::string(argv[1]) == "serve") {
+            std::vector<std::string> positional;
+            std::string metricsFile;
+            for (int a = 2; a < argc; a++) {
+                if (std::string(argv[a]) == "--metrics-file" && a + 1 < argc) {
+                    metricsFile = argv[++a];
+                } else {
+                    positional.push_back(argv[a]);
+                }
+            }
+            uint16_t port = static_cast<uint16_t>(positional.size() > 0 ? std::atoi(positional[0].c_str()) : 7070);
+            serveNetwork(port, positional.size() > 1 ? positional[1] : "", metricsFile);
+            return 0;
+        }
+        if (argc > 1 && std::string(argv[1]) == "profile") {
+            std::string path = argc > 2 ? argv[2] : "";
+            size_t samples = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+            profileNetwork(path, samples);
+            return 0;
+        }
+        if (argc > 1 && std::string(argv[1]) == "bench-topk") {
+            size_t friendCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2000;
+            size_t noiseCount = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 90000;
+            benchmarkTopK(friendCount, noiseCount);
+            return 0;
+        }
+        if (argc > 1 && std::string(argv[1]) == "bench-build") {
+            size_t edgeCount = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+            int users = argc > 3 ? std::atoi(argv[3]) : 100000;
+            benchmarkConstruction(edgeCount, std::max(users, 2));
+            return 0;
+        }
         demonstrateSocialNetwork();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;